@@ -0,0 +1,103 @@
+#include "hoc.h"
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * 領域(リージョン)単位のメモリ割り当て
+ * 個々の解放はせず、arena_resetで全部まとめて捨てる
+ * 確保したブロックはresetしても手放さず次に再利用するので、
+ * 文ごとにresetしてもmallocは呼ばれない
+ */
+
+struct Block {
+  struct Block *next;
+  size_t size;     /* usable bytes after the header */
+};
+
+#define ALIGN(n) (((n) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+#define HDR ALIGN(sizeof(struct Block))
+
+void arena_init(Arena *a, size_t blocksize)
+{
+  a->head = a->cur = 0;
+  a->next = a->limit = 0;
+  a->blocksize = blocksize;
+  a->nalloc = a->nblock = a->nreset = 0;
+  a->used = a->peak = a->reserved = 0;
+}
+
+static void newblock(Arena *a, size_t n) /* make room for n bytes */
+{
+  struct Block *b = a->cur ? a->cur->next : a->head;
+
+  while (b && b->size < n) { /* resetで残ったブロックから探す */
+    b = b->next;
+  }
+  if (b == 0) {
+    size_t size = n > a->blocksize ? n : a->blocksize;
+    b = (struct Block *)malloc(HDR + size);
+    if (b == 0) {
+      execerror("out of memory", (char *) 0);
+    }
+    b->size = size;
+    if (a->cur) {
+      b->next = a->cur->next;
+      a->cur->next = b;
+    } else {
+      b->next = a->head;
+      a->head = b;
+    }
+    a->nblock++;
+    a->reserved += size;
+  }
+  a->cur = b;
+  a->next = (char *)b + HDR;
+  a->limit = a->next + b->size;
+}
+
+void *arena_alloc(Arena *a, size_t n)
+{
+  char *p;
+
+  n = ALIGN(n);
+  if (a->next == 0 || n > (size_t)(a->limit - a->next)) {
+    newblock(a, n);
+  }
+  p = a->next;
+  a->next += n;
+  a->nalloc++;
+  a->used += n;
+  if (a->used > a->peak) {
+    a->peak = a->used;
+  }
+  return p;
+}
+
+void arena_reset(Arena *a) /* discard everything, keep the blocks */
+{
+  a->cur = a->head;
+  if (a->head) {
+    a->next = (char *)a->head + HDR;
+    a->limit = a->next + a->head->size;
+  }
+  a->used = 0;
+  a->nreset++;
+}
+
+void arena_free(Arena *a)
+{
+  struct Block *b, *next;
+
+  for (b = a->head; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  arena_init(a, a->blocksize);
+}
+
+void arena_stats(Arena *a, const char *name, FILE *fp)
+{
+  fprintf(fp, "%s: %lu allocs, %lu bytes in use, peak %lu, %lu blocks (%lu bytes), %lu resets\n",
+          name, (unsigned long)a->nalloc, (unsigned long)a->used, (unsigned long)a->peak,
+          (unsigned long)a->nblock, (unsigned long)a->reserved, (unsigned long)a->nreset);
+}
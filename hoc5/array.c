@@ -0,0 +1,523 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * 配列変数  n = load("file" [, x, y, ...])
+ *
+ * ファイルの列をそれぞれ数値の配列にし、x[0] ... x[n-1] で読めるようにする。値は行数。
+ * 配列の名前は並べたものを列の順に使う。並べなければテキストの1行目の名前を使う
+ * (1行目が数で始まらなければ名前の行とみなす)。
+ *
+ * テキストはmmapしたバッファの上で直接数値に直す。区切りは $n のフィールドと同じ。
+ * 無いフィールドや数でないフィールドは0。
+ * 列形式のバイナリ (data.c) は列がそのままdoubleの並びなので、mmapした領域を
+ * コピーせずに配列にする。同じファイルの配列は1つの領域を共有し、最後の1つが
+ * 無くなったらmunmapする。
+ *
+ * a = mapfile("file" [, "mode"])
+ * このマシンのdoubleを並べただけのファイルをmmapして、そのまま配列aにする。値は要素の数。
+ * 読み込まないので、メモリより大きいファイルでもページ単位で必要なところだけ読まれる。
+ * modeの文字
+ *   w  a[i] = x をファイルに書き戻す (MAP_SHARED 配列を手放すときにmsync)
+ *      無ければ書き込みはこのVMの中だけ (MAP_PRIVATE)
+ *   s  前から順に読む (MADV_SEQUENTIAL)
+ *   r  飛び飛びに読む (MADV_RANDOM)
+ */
+
+typedef struct Mapping { /* mmapしたファイル */
+  char *base;
+  size_t len;
+  int refs;            /* この領域を使っている配列の数 */
+  int shared;          /* ファイルに書き戻す */
+} Mapping;
+
+static const double pow10[] = { /* 正確に表せる10のべき */
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static int isfs(int c) /* field separator, as in data.c */
+{
+  return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+static int eight(const char *p) /* p[0..7] are all digits */
+{
+  uint64_t x;
+
+  memcpy(&x, p, 8);
+  return ((x & 0xF0F0F0F0F0F0F0F0ULL) |
+          (((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
+}
+
+static uint64_t eightval(const char *p) /* value of 8 digits (little endian) */
+{
+  uint64_t x;
+
+  /* 1つの64ビット整数で隣どうしの桁を2桁、4桁、8桁とまとめる */
+  memcpy(&x, p, 8);
+  x -= 0x3030303030303030ULL;
+  x = x * 10 + (x >> 8);
+  x = (((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+       (((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+  return x & 0xFFFFFFFF;
+}
+
+static double slow(const char *p, const char *e) /* strtod of [p, e) */
+{
+  char buf[128];
+  size_t n = e - p < (long)sizeof(buf) - 1 ? (size_t)(e - p) : sizeof(buf) - 1;
+
+  memcpy(buf, p, n);
+  buf[n] = '\0';
+  return strtod(buf, (char **) 0);
+}
+
+static double number(const char *p, const char *e) /* value of the field [p, e) */
+{
+  /*
+   * 仮数が19桁以内で2^53以下、10の指数が±22以内なら、仮数と10のべきはどちらも
+   * doubleで正確に表せるので、1回の掛け算か割り算で正しく丸めた値になる。
+   * それ以外 (長い仮数, 大きな指数, 後ろに数でない文字が続くもの) はstrtodに任せる。
+   */
+  const char *s = p;
+  uint64_t m = 0;
+  int neg = 0, nd = 0, any = 0, lost = 0, ex = 0, eneg = 0;
+  long exp = 0;
+
+  if (p < e && (*p == '-' || *p == '+')) {
+    neg = *p++ == '-';
+  }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (nd <= 11 && p + 8 <= e && eight(p)) {
+    m = m * 100000000 + eightval(p);
+    nd += 8;
+    any = 1;
+    p += 8;
+  }
+#endif
+  for (; p < e && isdigit((unsigned char)*p); p++, any = 1) {
+    if (nd < 19) {
+      m = m * 10 + (*p - '0');
+      nd += m != 0;
+    } else {
+      exp++;
+      lost |= *p != '0';
+    }
+  }
+  if (p < e && *p == '.') {
+    p++;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    while (nd <= 11 && p + 8 <= e && eight(p)) {
+      m = m * 100000000 + eightval(p);
+      nd += 8;
+      exp -= 8;
+      any = 1;
+      p += 8;
+    }
+#endif
+    for (; p < e && isdigit((unsigned char)*p); p++, any = 1) {
+      if (nd < 19) {
+        m = m * 10 + (*p - '0');
+        nd += m != 0;
+        exp--;
+      } else {
+        lost |= *p != '0';
+      }
+    }
+  }
+  if (!any) { /* inf, nan など */
+    return slow(s, e);
+  }
+  if (p < e && (*p == 'e' || *p == 'E')) {
+    p++;
+    if (p < e && (*p == '-' || *p == '+')) {
+      eneg = *p++ == '-';
+    }
+    for (; p < e && isdigit((unsigned char)*p); p++) {
+      ex = ex < 10000 ? ex * 10 + (*p - '0') : ex;
+    }
+    exp += eneg ? -ex : ex;
+  }
+  if (p != e || lost || m > (1ULL << 53) || exp < -22 || exp > 22) {
+    return slow(s, e);
+  }
+  if (exp < 0) {
+    return neg ? -((double)m / pow10[-exp]) : (double)m / pow10[-exp];
+  }
+  return neg ? -((double)m * pow10[exp]) : (double)m * pow10[exp];
+}
+
+static void unmap(Mapping *m)
+{
+  if (m && --m->refs == 0) {
+    if (m->shared) {
+      msync(m->base, m->len, MS_SYNC);
+    }
+    munmap(m->base, m->len);
+    free(m);
+  }
+}
+
+static void release(Array *a)
+{
+  if (a->map) {
+    unmap(a->map);
+  } else {
+    free(a->v);
+  }
+  a->v = 0;
+  a->n = 0;
+  a->map = 0;
+}
+
+static void bind(Symbol *sp, double *v, long n, Mapping *map) /* make sp the array v[0..n-1] */
+{
+  if (sp->type == ARRAY) {
+    release(sp->u.arr);
+  } else {
+    sp->u.arr = (Array *)arena_alloc(&curvm->symarena, sizeof(Array));
+    sp->type = ARRAY;
+  }
+  sp->u.arr->v = v;
+  sp->u.arr->n = n;
+  sp->u.arr->map = map;
+  if (map) {
+    map->refs++;
+  }
+  changed(sp);
+}
+
+static Symbol *column(const char *p, const char *e) /* array named by the header field [p, e) */
+{
+  char name[100];
+  const char *q;
+  Symbol *sp;
+
+  if (e - p >= 2 && *p == '"' && e[-1] == '"') {
+    p++;
+    e--;
+  }
+  for (q = p; q < e && isalnum((unsigned char)*q); q++) {
+  }
+  if (p == e || q != e || !isalpha((unsigned char)*p) || e - p >= (long)sizeof(name)) {
+    return 0;
+  }
+  memcpy(name, p, e - p);
+  name[e - p] = '\0';
+  if ((sp = lookup(name)) == 0) {
+    sp = install(name, UNDEF, 0.0);
+  }
+  return sp;
+}
+
+static _Thread_local const char *why, *what; /* loadのエラー */
+
+static long fail(const char *s, const char *t)
+{
+  why = s;
+  what = t;
+  return -1;
+}
+
+static long text(char *p, char *end, Symbol **names, const char *file) /* load columns of text, -1 on error */
+{
+  Symbol *hdr[NFIELD];
+  double *col[NFIELD];
+  char *eol, *f;
+  long rows = 0, maxrows = 0;
+  int k, ncols = 0, nf;
+
+  while (p < end && (isfs(*p) || *p == '\n')) { /* 先頭の空行 */
+    p++;
+  }
+  if (p < end && !isdigit((unsigned char)*p) && *p != '.' && *p != '-' && *p != '+') {
+    eol = memchr(p, '\n', end - p);
+    eol = eol ? eol : end;
+    for (; p < eol && ncols < NFIELD && !names[0]; ncols++) { /* 名前を並べたなら読み飛ばす */
+      for (f = p; p < eol && !isfs(*p); p++) {
+      }
+      if ((hdr[ncols] = column(f, p)) == 0) {
+        return fail("bad column name in ", file);
+      }
+      while (p < eol && isfs(*p)) {
+        p++;
+      }
+    }
+    p = eol;
+  }
+  if (names[0]) {
+    for (ncols = 0; names[ncols] && ncols < NFIELD; ncols++) {
+      hdr[ncols] = names[ncols];
+    }
+  }
+  if (ncols == 0) {
+    return fail("no column names in ", file);
+  }
+  for (k = 0; k < ncols; k++) {
+    if (hdr[k]->type != UNDEF && hdr[k]->type != ARRAY) {
+      return fail("can't load into ", hdr[k]->name);
+    }
+  }
+
+  /* 改行の数で行数の上限を決め、各列を一度に確保する */
+  for (f = p; f < end && (f = memchr(f, '\n', end - f)) != 0; f++) {
+    maxrows++;
+  }
+  maxrows++;
+  for (k = 0; k < ncols; k++) {
+    if ((col[k] = (double *)malloc(maxrows * sizeof(double))) == 0) {
+      while (--k >= 0) {
+        free(col[k]);
+      }
+      return fail("out of memory", (char *) 0);
+    }
+  }
+  for (; p < end; p = eol + 1) {
+    eol = memchr(p, '\n', end - p);
+    eol = eol ? eol : end;
+    for (nf = 0; nf < ncols; nf++) {
+      while (p < eol && isfs(*p)) {
+        p++;
+      }
+      if (p >= eol) {
+        break;
+      }
+      for (f = p; p < eol && !isfs(*p); p++) {
+      }
+      col[nf][rows] = number(f, p);
+    }
+    if (nf == 0) { /* 空行 */
+      continue;
+    }
+    for (k = nf; k < ncols; k++) {
+      col[k][rows] = 0;
+    }
+    rows++;
+  }
+  for (k = 0; k < ncols; k++) {
+    bind(hdr[k], col[k], rows, 0);
+  }
+  return rows;
+}
+
+static long binary(Mapping *m, Symbol **names, const char *file) /* columnar data without copying, -1 on error */
+{
+  uint64_t nrows, ncols;
+  int k;
+
+  memcpy(&nrows, m->base + 8, 8);
+  memcpy(&ncols, m->base + 16, 8);
+  if (ncols != 0 && nrows > (m->len - COLHDR) / sizeof(double) / ncols) {
+    return fail("short columnar file ", file);
+  }
+  if (names[0] == 0) {
+    return fail("no column names in ", file);
+  }
+  for (k = 0; names[k]; k++) {
+    if ((uint64_t)k >= ncols) {
+      return fail("not that many columns in ", file);
+    }
+    if (names[k]->type != UNDEF && names[k]->type != ARRAY) {
+      return fail("can't load into ", names[k]->name);
+    }
+  }
+  for (k = 0; names[k]; k++) {
+    bind(names[k], (double *)(m->base + COLHDR) + k * nrows, nrows, m);
+  }
+  return nrows;
+}
+
+static long load(const char *file, Symbol **names) /* number of rows loaded */
+{
+  Mapping *m = 0;
+  struct stat st;
+  char *p;
+  long n;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    execerror("can't open ", file);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    p = "";
+    n = text(p, p, names, file);
+  } else {
+    p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0); /* a[i] = x はコピーに */
+    close(fd);
+    if (p == MAP_FAILED) {
+      execerror("can't map ", file);
+    }
+    if ((size_t)st.st_size >= COLHDR && memcmp(p, COLMAGIC, 8) == 0 &&
+        (m = (Mapping *)malloc(sizeof(Mapping))) != 0) {
+      m->base = p;
+      m->len = st.st_size;
+      m->refs = 1; /* 配列が1つも使わなければここで捨てる */
+      m->shared = 0;
+      n = binary(m, names, file);
+      unmap(m);
+    } else {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      n = text(p, p + st.st_size, names, file);
+      munmap(p, st.st_size);
+    }
+  }
+  if (n < 0) {
+    execerror(why, what);
+  }
+  return n;
+}
+
+void loadcode(void) /* push number of rows of load("file", names) */
+{
+  HocVM *vm = curvm;
+  char *file = (char *)vm->pc[0];
+  Symbol **names = (Symbol **)vm->pc[1];
+
+  vm->pc += 2;
+  if (vm->inparallel) {
+    execerror("load in parallel for", (char *) 0);
+  }
+  if (vm->nofiles) {
+    execerror("file access not allowed: ", file);
+  }
+  push(mkinteger(load(file, names)));
+}
+
+void mapcode(void) /* a = mapfile("file", "mode"): push number of elements */
+{
+  HocVM *vm = curvm;
+  Symbol *sp = (Symbol *)vm->pc[0];
+  char *file = (char *)vm->pc[1], *mode = (char *)vm->pc[2], *p;
+  int fd, write = 0, advice = MADV_NORMAL;
+  struct stat st;
+  Mapping *m;
+
+  vm->pc += 3;
+  for (p = mode; p && *p; p++) {
+    if (*p == 'w') {
+      write = 1;
+    } else if (*p == 's' || *p == 'r') {
+      advice = *p == 's' ? MADV_SEQUENTIAL : MADV_RANDOM;
+    } else {
+      execerror("bad mapfile mode ", mode);
+    }
+  }
+  if (vm->inparallel) {
+    execerror("mapfile in parallel for", (char *) 0);
+  }
+  if (vm->nofiles) {
+    execerror("file access not allowed: ", file);
+  }
+  if (sp->type != UNDEF && sp->type != ARRAY) {
+    execerror("can't map into ", sp->name);
+  }
+  if ((fd = open(file, write ? O_RDWR : O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    execerror("can't open ", file);
+  }
+  if (st.st_size % sizeof(double) != 0) {
+    close(fd);
+    execerror("not a file of doubles: ", file);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    bind(sp, 0, 0, 0);
+    push(mkint(0));
+    return;
+  }
+  p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, write ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    execerror("can't map ", file);
+  }
+  if ((m = (Mapping *)malloc(sizeof(Mapping))) == 0) {
+    munmap(p, st.st_size);
+    execerror("out of memory", (char *) 0);
+  }
+  madvise(p, st.st_size, advice);
+  m->base = p;
+  m->len = st.st_size;
+  m->refs = 0;
+  m->shared = write;
+  bind(sp, (double *)p, st.st_size / sizeof(double), m);
+  push(mkinteger(st.st_size / sizeof(double)));
+}
+
+static double *element(Symbol *sp, Datum d) /* &sp[d] */
+{
+  double x = num(d);
+  long i = (long)x;
+
+  if (sp->type != ARRAY) {
+    execerror("not an array: ", sp->name);
+  }
+  if (x != (double)i || i < 0 || i >= sp->u.arr->n) {
+    execerror("subscript out of range for ", sp->name);
+  }
+  return &sp->u.arr->v[i];
+}
+
+void arrpush(void) /* push a[top of stack] */
+{
+  HocVM *vm = curvm;
+  Symbol *sp = (Symbol *)*vm->pc++;
+  double *v = element(sp, pop());
+
+  if (vm->reading) { /* 導出変数の計算中 */
+    depend(sp);
+  }
+  push(mkvalue(*v));
+}
+
+void arrstore(void) /* a[index] = value, leave value on stack */
+{
+  HocVM *vm = curvm;
+  Symbol *sp = (Symbol *)*vm->pc++;
+  Datum d = pop();
+
+  *element(sp, pop()) = num(d);
+  changed(sp);
+  push(d);
+}
+
+Symbol **namelist(Symbol **list, Symbol *sp) /* list with sp appended, 0-terminated */
+{
+  Symbol **l;
+  int n = 0;
+
+  while (list && list[n]) {
+    n++;
+  }
+  l = (Symbol **)ctalloc((n + 2) * sizeof(Symbol *));
+  if (n > 0) {
+    memcpy(l, list, n * sizeof(Symbol *));
+  }
+  l[n] = sp;
+  l[n+1] = 0;
+  return l;
+}
+
+void array_free(HocVM *vm) /* release the storage of all arrays */
+{
+  Symbol *sp;
+
+  for (sp = vm->symlist; sp; sp = sp->next) {
+    if (sp->type == ARRAY) {
+      release(sp->u.arr);
+    }
+  }
+}
@@ -0,0 +1,147 @@
+#include "hoc.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 多数のプログラムを並列に実行する  hoc5 -j n [-s] [-R] prog...
+ *
+ * n個のスレッドが引数の前からプログラムを1つずつ取り、それぞれ新しいVMで
+ * hoc5 < prog と同じように実行する。VMどうしは何も共有しないので、ロックは
+ * 次のプログラムを取るときと終わりを知らせるときにしか使わない。
+ * print などの出力とエラーメッセージはプログラムごとにメモリにためておき、
+ * 引数の順に標準出力と標準エラー出力に書く。エラーメッセージの先頭は
+ * プログラムのファイル名になる。前のプログラムが全部終わったものから書くので、
+ * 出力の順はスレッドの数や実行の速さによらない。
+ */
+
+typedef struct Script {
+  const char *file;
+  char *out, *err;     /* ためた出力とエラーメッセージ */
+  size_t outlen, errlen;
+  int nerrors;
+  int done;
+} Script;
+
+typedef struct Batch {
+  Script *s;
+  int n;
+  int next;            /* 次に実行するプログラム */
+  int regvm;           /* -R */
+  int stats;
+  pthread_mutex_t mu;
+  pthread_cond_t done;
+} Batch;
+
+static void run(Script *s, int regvm, int stats) /* run one program, output into s */
+{
+  FILE *out = open_memstream(&s->out, &s->outlen);
+  FILE *err = open_memstream(&s->err, &s->errlen);
+  FILE *fp;
+  HocVM *vm;
+
+  if (out == 0 || err == 0 || (vm = vm_create()) == 0) {
+    fprintf(stderr, "out of memory\n");
+    s->nerrors = 1;
+  } else if ((fp = fopen(s->file, "r")) == 0) {
+    fprintf(err, "can't open %s\n", s->file);
+    s->nerrors = 1;
+    vm_free(vm);
+  } else {
+    vm->name = s->file;
+    vm->trace = 0;
+    vm->regvm = regvm;
+    vm->fout = out;
+    vm->ferr = err;
+    vm_load(vm, fp);
+    s->nerrors = vm_run(vm);
+    if (stats) {
+      vm_stats(vm, err);
+    }
+    vm_free(vm);
+  }
+  if (out) {
+    fclose(out);
+  }
+  if (err) {
+    fclose(err);
+  }
+}
+
+static void *worker(void *arg)
+{
+  Batch *b = (Batch *)arg;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&b->mu);
+    i = b->next++;
+    pthread_mutex_unlock(&b->mu);
+    if (i >= b->n) {
+      return 0;
+    }
+    run(&b->s[i], b->regvm, b->stats);
+    pthread_mutex_lock(&b->mu);
+    b->s[i].done = 1;
+    pthread_cond_broadcast(&b->done);
+    pthread_mutex_unlock(&b->mu);
+  }
+}
+
+int hocbatch(char **files, int nfiles, int nthreads, int regvm, int stats) /* run the programs on nthreads threads, return errors */
+{
+  Batch b;
+  pthread_t *tid;
+  double t = vm_clock();
+  int i, nerrors = 0;
+
+  b.s = (Script *)calloc(nfiles + 1, sizeof(Script));
+  tid = (pthread_t *)calloc(nthreads, sizeof(pthread_t));
+  if (b.s == 0 || tid == 0) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (i = 0; i < nfiles; i++) {
+    b.s[i].file = files[i];
+  }
+  b.n = nfiles;
+  b.next = 0;
+  b.regvm = regvm;
+  b.stats = stats;
+  pthread_mutex_init(&b.mu, 0);
+  pthread_cond_init(&b.done, 0);
+  nthreads = nthreads < nfiles ? nthreads : nfiles;
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&tid[i], 0, worker, &b) != 0) {
+      nthreads = i; /* 作れた分だけで実行する */
+      break;
+    }
+  }
+  if (nthreads == 0) {
+    worker(&b);
+  }
+  for (i = 0; i < nfiles; i++) { /* 引数の順に書き出す */
+    pthread_mutex_lock(&b.mu);
+    while (!b.s[i].done) {
+      pthread_cond_wait(&b.done, &b.mu);
+    }
+    pthread_mutex_unlock(&b.mu);
+    fwrite(b.s[i].out, 1, b.s[i].outlen, stdout);
+    fflush(stdout);
+    fwrite(b.s[i].err, 1, b.s[i].errlen, stderr);
+    nerrors += b.s[i].nerrors;
+    free(b.s[i].out);
+    free(b.s[i].err);
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(tid[i], 0);
+  }
+  if (stats) {
+    fprintf(stderr, "batch: %d programs, %d threads, %.3f s\n", nfiles, nthreads, vm_clock() - t);
+  }
+  pthread_mutex_destroy(&b.mu);
+  pthread_cond_destroy(&b.done);
+  free(b.s);
+  free(tid);
+  return nerrors;
+}
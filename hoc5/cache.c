@@ -0,0 +1,315 @@
+#define _GNU_SOURCE /* fopencookie */
+#include "hoc.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 文のキャッシュ (vm_run)
+ *
+ * 入力を1行ずつ先に読み、前に翻訳したのと同じ形の行なら字句解析も構文解析も
+ * せずに、取っておいたコードを実行する。形は空白をまとめて数値定数を # にした
+ * テキストで比べ、定数の値はコードが参照している定数のシンボルに書き込む。
+ *   x = x * 1.5 + 2   と   x = x*3 + 4   はどちらも  "x = x*# + #"
+ * 1行で1つの文になっている行だけを取っておく。最適化で畳み込まれたりして
+ * コードから消えた定数があれば、定数の値まで同じ行にだけ使う (exact)。
+ * 関数や導出変数を定義すると全部捨てる。
+ * 取っておく行の翻訳中だけvm->keepをキャッシュの領域にして、定数などをコードと
+ * 同じ寿命にする。取っておかない行の定数はふつうにstmtarenaに置く。
+ *
+ * lexerにはfopencookieで作ったバッファを持たないストリームから行を渡すので、
+ * lexerがその行のどこまで読んだか (pos) が分かる。
+ */
+
+#define NSTMT 256          /* cached statements */
+#define MAXCACHE (1 << 20) /* これより大きくなったら捨てて作り直す */
+
+typedef struct Stmt {
+  char *key;         /* 0: empty slot */
+  size_t keylen;
+  int nlit;
+  int exact;         /* 定数の値も同じときだけ使う */
+  Symbol **lit;      /* 値を書き込む定数 */
+  double *val;       /* 翻訳したときの定数の値 */
+  Inst *code;
+} Stmt;
+
+typedef struct StmtCache {
+  Stmt tab[NSTMT];
+  int n;
+  long ndefs;        /* vm->ndefsがこれと違えば捨てる */
+  Arena arena;       /* 取っておくコードと定数 */
+  long hits, misses;
+  FILE *src;         /* 本当の入力 */
+  char *line;        /* 先に読んだ行 */
+  size_t cap, len, pos; /* lexerはline[pos]から読む */
+  int more;          /* 翻訳中にlexerが次の行を読んだ */
+  char *key;         /* the line with literals replaced by # */
+  size_t keylen, keycap;
+  uint64_t hash;
+  double val[NLIT];
+  int nlit;
+  int ok;            /* この行は取っておける形 */
+  int nerrors;
+  int active;        /* stmt_openからstmt_closeまで */
+} StmtCache;
+
+uint64_t strhash(const char *s, size_t n) /* FNV-1a, never 0 */
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (n-- > 0) {
+    h = (h ^ (unsigned char)*s++) * 0x100000001b3ULL;
+  }
+  return h ? h : 1;
+}
+
+static ssize_t readline(void *cookie, char *buf, size_t size) /* lexer reads from here */
+{
+  StmtCache *sc = (StmtCache *)cookie;
+  ssize_t n;
+
+  if (sc->pos >= sc->len) {
+    if ((n = getline(&sc->line, &sc->cap, sc->src)) <= 0) {
+      sc->len = sc->pos = 0;
+      return 0;
+    }
+    sc->len = n;
+    sc->pos = 0;
+    sc->more = 1;
+  }
+  n = sc->len - sc->pos < size ? sc->len - sc->pos : size;
+  memcpy(buf, sc->line + sc->pos, n);
+  sc->pos += n;
+  return n;
+}
+
+static void clear(HocVM *vm, StmtCache *sc)
+{
+  memset(sc->tab, 0, sizeof(sc->tab));
+  sc->n = 0;
+  sc->ndefs = vm->ndefs;
+  arena_reset(&sc->arena);
+}
+
+void stmt_open(HocVM *vm) /* read the program through the cache */
+{
+  static cookie_io_functions_t io = { readline, 0, 0, 0 };
+  StmtCache *sc = vm->scache;
+
+  if (sc == 0) {
+    sc = vm->scache = (StmtCache *)calloc(1, sizeof(StmtCache));
+    if (sc == 0) {
+      return;
+    }
+    arena_init(&sc->arena, 16384);
+    sc->ndefs = vm->ndefs;
+  }
+  sc->src = vm->fin;
+  sc->len = sc->pos = 0;
+  if ((vm->fin = fopencookie(sc, "r", io)) == 0) {
+    vm->fin = sc->src;
+    return;
+  }
+  setvbuf(vm->fin, 0, _IONBF, 0);
+  sc->active = 1;
+}
+
+void stmt_close(HocVM *vm)
+{
+  StmtCache *sc = vm->scache;
+
+  if (sc && sc->active) {
+    fclose(vm->fin);
+    vm->fin = sc->src;
+    vm->keep = 0;
+    sc->active = 0;
+  }
+}
+
+void stmt_free(HocVM *vm)
+{
+  if (vm->scache) {
+    arena_free(&vm->scache->arena);
+    free(vm->scache->line);
+    free(vm->scache->key);
+    free(vm->scache);
+  }
+}
+
+static void addkey(StmtCache *sc, int c)
+{
+  if (sc->keylen >= sc->keycap) {
+    sc->keycap = sc->keycap ? 2 * sc->keycap : 256;
+    sc->key = realloc(sc->key, sc->keycap);
+  }
+  if (sc->key) {
+    sc->key[sc->keylen++] = c;
+  }
+}
+
+static int normalize(StmtCache *sc) /* make the key of the line, 0 if it can't be cached */
+{
+  char *p = sc->line, *end = sc->line + sc->len - 1, *e;
+
+  sc->keylen = 0;
+  sc->nlit = 0;
+  if (sc->len == 0 || *end != '\n') {
+    return 0;
+  }
+  while (p < end) {
+    if (*p == ' ' || *p == '\t') {
+      while (*p == ' ' || *p == '\t') {
+        p++;
+      }
+      addkey(sc, ' ');
+    } else if (isalpha((unsigned char)*p)) { /* 名前の中の数字は定数ではない */
+      while (isalnum((unsigned char)*p)) {
+        addkey(sc, *p++);
+      }
+    } else if (*p == '$') {
+      do {
+        addkey(sc, *p++);
+      } while (isdigit((unsigned char)*p));
+    } else if (*p == '"') {
+      do {
+        addkey(sc, *p++);
+      } while (p < end && *p != '"');
+    } else if (*p == '.' || isdigit((unsigned char)*p)) {
+      if (sc->nlit >= NLIT) {
+        return 0;
+      }
+      sc->val[sc->nlit++] = strtod(p, &e);
+      if (e == p) {
+        return 0;
+      }
+      p = e;
+      addkey(sc, '#');
+    } else if (*p == '#') {
+      return 0;
+    } else {
+      addkey(sc, *p++);
+    }
+  }
+  if (sc->key == 0) {
+    return 0;
+  }
+  sc->hash = strhash(sc->key, sc->keylen);
+  return 1;
+}
+
+Inst *stmt_lookup(HocVM *vm) /* code for the next input line, 0 if it has to be parsed */
+{
+  static Inst blank[] = { STOP };
+  StmtCache *sc = vm->scache;
+  Stmt *s;
+  ssize_t n;
+  int i;
+
+  if (sc == 0 || !sc->active) {
+    return 0;
+  }
+  vm->keep = 0;
+  sc->ok = 0;
+  if (sc->pos < sc->len) { /* 前の行の残り (read()で途中まで読んだなど) */
+    return 0;
+  }
+  if ((n = getline(&sc->line, &sc->cap, sc->src)) <= 0) {
+    sc->len = sc->pos = 0;
+    return 0;
+  }
+  sc->len = n;
+  sc->pos = 0;
+  sc->more = 0;
+  sc->nerrors = vm->nerrors;
+  if (vm->ndefs != sc->ndefs) {
+    clear(vm, sc);
+  }
+  if (!normalize(sc)) {
+    return 0;
+  }
+  if (sc->keylen == 0 || (sc->keylen == 1 && sc->key[0] == ' ')) { /* 空行 */
+    sc->pos = sc->len;
+    vm->lineno++;
+    return blank;
+  }
+  s = &sc->tab[sc->hash % NSTMT];
+  if (s->key && s->nlit == sc->nlit && s->keylen == sc->keylen &&
+      memcmp(s->key, sc->key, sc->keylen) == 0 &&
+      (!s->exact || memcmp(s->val, sc->val, sc->nlit * sizeof(double)) == 0)) {
+    for (i = 0; i < sc->nlit; i++) {
+      s->lit[i]->u.v = mkvalue(sc->val[i]);
+    }
+    sc->pos = sc->len;
+    vm->lineno++;
+    sc->hits++;
+    return s->code;
+  }
+  sc->misses++;
+  if (sc->n >= NSTMT || sc->arena.used > MAXCACHE) {
+    clear(vm, sc);
+  }
+  sc->ok = 1;
+  vm->keep = &sc->arena; /* 取っておく行の定数 */
+  return 0;
+}
+
+static Symbol *mark(Symbol *sp, void *arg) /* codecopy map: note the literals the code reads */
+{
+  HocVM *vm = (HocVM *)arg;
+  int i;
+
+  for (i = 0; i < vm->nlit; i++) {
+    if (vm->lit[i] == sp) {
+      vm->lit[i] = 0;
+    }
+  }
+  return sp;
+}
+
+void stmt_remember(HocVM *vm) /* keep the statement just compiled in prog */
+{
+  StmtCache *sc = vm->scache;
+  Symbol *lit[NLIT];
+  Stmt *s;
+  int i, n;
+
+  if (sc == 0 || !sc->ok || sc->more || sc->pos < sc->len ||
+      vm->nerrors != sc->nerrors || vm->ndefs != sc->ndefs || vm->nlit != sc->nlit) {
+    return;
+  }
+  for (i = 0; i < vm->nlit; i++) {
+    if (num(vm->lit[i]->u.v) != sc->val[i]) { /* lexerと読み方が違った */
+      return;
+    }
+    lit[i] = vm->lit[i];
+  }
+  s = &sc->tab[sc->hash % NSTMT];
+  if (s->key == 0) {
+    sc->n++;
+  }
+  n = vm->progp - vm->prog;
+  s->code = (Inst *)arena_alloc(&sc->arena, n * sizeof(Inst));
+  codecopy(s->code, vm->prog, vm->progp, mark, vm);
+  s->exact = 0;
+  for (i = 0; i < vm->nlit; i++) {
+    if (vm->lit[i] != 0) { /* コードから消えた */
+      s->exact = 1;
+    }
+  }
+  s->key = memcpy(arena_alloc(&sc->arena, sc->keylen), sc->key, sc->keylen);
+  s->keylen = sc->keylen;
+  s->nlit = sc->nlit;
+  s->lit = (Symbol **)memcpy(arena_alloc(&sc->arena, sc->nlit * sizeof(Symbol *) + 1), lit, sc->nlit * sizeof(Symbol *));
+  s->val = (double *)memcpy(arena_alloc(&sc->arena, sc->nlit * sizeof(double) + 1), sc->val, sc->nlit * sizeof(double));
+}
+
+void stmt_stats(HocVM *vm, FILE *fp)
+{
+  StmtCache *sc = vm->scache;
+
+  if (sc) {
+    fprintf(fp, "statement cache: %ld hits, %ld misses, %d cached\n", sc->hits, sc->misses, sc->n);
+    arena_stats(&sc->arena, "cache", fp);
+  }
+}
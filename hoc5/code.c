@@ -3,16 +3,9 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define NSTACK 256
-static Datum stack[NSTACK]; /* the stack */
-static Datum *stackp; /* next free spot on stack */
-
-#define NPROG 2000
-Inst prog[NPROG]; /* the machine */
-Inst *progp; /* next free spot for code generation */
-
-Inst *pc;
+#define pc (curvm->pc) /* 実行中VMのプログラムカウンタ */
 
 /* 命令オペランドタイプを示す定数 マシンの表示に使用する */
 #define OP_NONE 0 /* オペランドなし add, mul など */
@@ -20,49 +13,66 @@ Inst *pc;
 #define OP_BLTIN 2 /* 組み込み関数ポインタをもつ */
 #define OP_ADDRS 3 /* 複数のアドレスを利用するもの if, while など */
 
-/* マシンのデバック表示をするか */
-static int trace_enabled = 1;
-
 static struct {
   Inst func;
   const char *name;
   int op_type;
+  const char *operands; /* 命令に続くオペランドの種類 s:シンボル f:関数 a:アドレス p:その他のポインタ n:整数 */
 } inst_table[] = {
-  {constpush, "constpush", OP_SYMBOL},
-  {varpush, "varpush", OP_SYMBOL},
-  {add, "add", OP_NONE},
-  {sub, "sub", OP_NONE},
-  {mul, "mul", OP_NONE},
-  {divide, "divide", OP_NONE},
-  {negate, "negate", OP_NONE},
-  {power, "power", OP_NONE},
-  {eval, "eval", OP_NONE},
-  {assign, "assign", OP_NONE},
-  {addeq, "addeq", OP_NONE},
-  {subeq, "subeq", OP_NONE},
-  {muleq, "muleq", OP_NONE},
-  {diveq, "diveq", OP_NONE},
-  {pre_increment, "pre_increment", OP_NONE},
-  {post_increment, "post_increment", OP_NONE},
-  {pre_decrement, "pre_decrement", OP_NONE},
-  {post_decrement, "post_decrement", OP_NONE},
-  {print, "print", OP_NONE},
-  {prexpr, "prexpr", OP_NONE},
-  {popstack, "popstack", OP_NONE},
-  {bltin, "bltin", OP_BLTIN},
-  {gt, "gt", OP_NONE},
-  {lt, "lt", OP_NONE},
-  {eq, "eq", OP_NONE},
-  {ge, "ge", OP_NONE},
-  {le, "le", OP_NONE},
-  {ne, "ne", OP_NONE},
-  {and, "and", OP_NONE},
-  {or, "or", OP_NONE},
-  {not, "not", OP_NONE},
-  {whilecode, "whilecode", OP_ADDRS},
-  {ifcode, "ifcode", OP_ADDRS},
-  {STOP, "STOP", OP_NONE},
-  {NULL, NULL, 0}  /* Sentinel */
+  {constpush, "constpush", OP_SYMBOL, "s"},
+  {varpush, "varpush", OP_SYMBOL, "s"},
+#define BINOP_ENTRY(name, expr, swapped) \
+  {name, #name, OP_NONE, ""}, \
+  {name##_k, #name "_k", OP_SYMBOL, "s"},
+  BINOPS(BINOP_ENTRY)
+  {negate, "negate", OP_NONE, ""},
+  {power, "power", OP_NONE, ""},
+  {eval, "eval", OP_NONE, ""},
+  {assign, "assign", OP_NONE, ""},
+  {addeq, "addeq", OP_NONE, ""},
+  {subeq, "subeq", OP_NONE, ""},
+  {muleq, "muleq", OP_NONE, ""},
+  {diveq, "diveq", OP_NONE, ""},
+  {pre_increment, "pre_increment", OP_NONE, ""},
+  {post_increment, "post_increment", OP_NONE, ""},
+  {pre_decrement, "pre_decrement", OP_NONE, ""},
+  {post_decrement, "post_decrement", OP_NONE, ""},
+  {print, "print", OP_NONE, ""},
+  {prexpr, "prexpr", OP_NONE, ""},
+  {popstack, "popstack", OP_NONE, ""},
+  {bltin, "bltin", OP_BLTIN, "f"},
+  {andcode, "andcode", OP_ADDRS, "a"},
+  {orcode, "orcode", OP_ADDRS, "a"},
+  {truth, "truth", OP_NONE, ""},
+  {not, "not", OP_NONE, ""},
+  {whilecode, "whilecode", OP_ADDRS, "aa"},
+  {forcode, "forcode", OP_ADDRS, "aaa"},
+  {forloop, "forloop", OP_ADDRS, "aasssnn"},
+  {ifcode, "ifcode", OP_ADDRS, "aaa"},
+  {timecode, "timecode", OP_ADDRS, "aa"},
+  {parforcode, "parforcode", OP_ADDRS, "spaaa"},
+  {fieldpush, "fieldpush", OP_NONE, "n"},
+  {varread, "varread", OP_SYMBOL, "s"},
+  {loadcode, "loadcode", OP_NONE, "pp"},
+  {mapcode, "mapcode", OP_NONE, "spp"},
+  {arrpush, "arrpush", OP_NONE, "s"},
+  {arrstore, "arrstore", OP_NONE, "s"},
+  {savecode, "savecode", OP_NONE, "p"},
+  {restorecode, "restorecode", OP_NONE, "p"},
+  {call, "call", OP_SYMBOL, "sn"},
+  {tailcall, "tailcall", OP_SYMBOL, "sn"},
+  {arg, "arg", OP_NONE, "n"},
+  {argassign, "argassign", OP_NONE, "n"},
+  {funcret, "funcret", OP_NONE, ""},
+  {procret, "procret", OP_NONE, ""},
+  {argstore, "argstore", OP_SYMBOL, "s"},
+  {tmpval, "tmpval", OP_SYMBOL, "s"},
+  {invreset, "invreset", OP_SYMBOL, "s"},
+  {invar, "invar", OP_ADDRS, "sa"},
+  {invstore, "invstore", OP_SYMBOL, "s"},
+  {duptop, "dup", OP_NONE, ""},
+  {STOP, "STOP", OP_NONE, ""},
+  {NULL, NULL, 0, NULL}  /* Sentinel */
 };
 
 /* 命令名検索 */
@@ -78,10 +88,64 @@ static const char* lookup_inst_name(Inst func, int *op_type) {
   return "UNKNOWN";
 }
 
+/* 命令のオペランド記述を返す 未知の命令なら0 */
+const char *inst_operands(Inst func)
+{
+  int i;
+  if (func == STOP) {
+    return "";
+  }
+  for (i = 0; inst_table[i].func != NULL; i++) {
+    if (inst_table[i].func == func) {
+      return inst_table[i].operands;
+    }
+  }
+  return 0;
+}
+
+int inst_len(Inst *p) /* number of slots used by the instruction at p */
+{
+  const char *ops = inst_operands(*p);
+  if (ops == 0) {
+    execerror("unknown instruction", (char *) 0);
+  }
+  return 1 + strlen(ops);
+}
+
+/*
+ * [from, to) のコードを dst に複写する
+ * [from, to] を指すアドレスは複写先に付け替え、シンボルは map があれば置き換える
+ */
+void codecopy(Inst *dst, Inst *from, Inst *to, Symbol *(*map)(Symbol *, void *), void *arg)
+{
+  Inst *p, *q;
+  const char *ops;
+
+  for (p = from, q = dst; p < to; ) {
+    ops = inst_operands(*p);
+    if (ops == 0) {
+      execerror("unknown instruction", (char *) 0);
+    }
+    *q++ = *p++;
+    for (; *ops; ops++, p++, q++) {
+      Inst *addr = (Inst *)*p;
+      if (*ops == 'a' && addr >= from && addr <= to) {
+        *q = (Inst)(dst + (addr - from));
+      } else if (*ops == 's' && map) {
+        *q = (Inst)(*map)((Symbol *)*p, arg);
+      } else {
+        *q = *p;
+      }
+    }
+  }
+}
+
 /* マシンの情報を表示 */
 static void trace_instructon(Inst *pc_current) {
   int op_type;
   const char *name = lookup_inst_name(*pc_current, &op_type);
+  const char *ops = inst_operands(*pc_current);
+  Inst *prog = curvm->prog;
   long offset = pc_current - prog;
   int i;
 
@@ -91,7 +155,7 @@ static void trace_instructon(Inst *pc_current) {
   switch(op_type){
     case OP_SYMBOL: {
       Symbol *sym = (Symbol *)(*(pc_current + 1));
-      fprintf(stderr, " sym='%s' val=%.8g", sym->name, sym->u.val);
+      fprintf(stderr, " sym='%s' val=%.8g", sym->name, num(sym->u.v));
       break;
     }
     case OP_BLTIN: {
@@ -100,19 +164,24 @@ static void trace_instructon(Inst *pc_current) {
       break;
     }
     case OP_ADDRS: {
-      Inst **addr1 = (Inst **)(pc_current + 1);
-      Inst **addr2 = (Inst **)(pc_current + 2);
-      Inst **addr3 = (Inst **)(pc_current + 3);
-      fprintf(stderr, " [%ld,%ld,%ld]", 
-              *addr1 ? *addr1 - prog : -1, /* アドレスが有効ならオフセット、無効なら-1 */
-              *addr2 ? *addr2 - prog : -1,
-              *addr3 ? *addr3 - prog : -1
-              );
+      /* アドレスが有効ならオフセット、無効なら-1 */
+      fprintf(stderr, " [");
+      for (i = 0; ops[i]; i++) {
+        Inst *addr = (Inst *)pc_current[i + 1];
+        if (ops[i] == 'a') {
+          fprintf(stderr, "%s%ld", i && ops[i-1] == 'a' ? "," : "", addr ? addr - prog : -1);
+        }
+      }
+      fprintf(stderr, "]");
       /* アドレススロットの詳細も表示 */
-      fprintf(stderr, "\n");
-      fprintf(stderr, "[%04ld]   <addr1>    -> %ld\n", offset+1, *addr1 ? *addr1 - prog : -1);
-      fprintf(stderr, "[%04ld]   <addr2>    -> %ld\n", offset+2, *addr2 ? *addr2 - prog : -1);
-      fprintf(stderr, "[%04ld]   <addr3>    -> %ld", offset+3, *addr3 ? *addr3 - prog : -1);
+      for (i = 0; ops[i]; i++) {
+        Inst *addr = (Inst *)pc_current[i + 1];
+        if (ops[i] == 'a') {
+          fprintf(stderr, "\n[%04ld]   <addr%d>    -> %ld", offset+i+1, i+1, addr ? addr - prog : -1);
+        } else if (ops[i] == 's') {
+          fprintf(stderr, "\n[%04ld]   <sym>      '%s'", offset+i+1, ((Symbol *)addr)->name);
+        }
+      }
       break;
     }
     case OP_NONE:
@@ -122,26 +191,42 @@ static void trace_instructon(Inst *pc_current) {
   fprintf(stderr, "\n");
 }
 
+void initstack(void) /* empty the stack and the call stack */
+{
+  HocVM *vm = curvm;
+  vm->stackp = vm->stack; /* stackが空なので先頭のアドレスを代入 */
+  vm->fp = vm->frame;
+  vm->depth = 0;
+  vm->returning = 0;
+  vm->reading = 0;
+}
+
 void initcode(void) /* initialize for code generation */
 {
-  stackp = stack; /* stackが空なので先頭のアドレスを代入 */
-  progp = prog; /* progが空なので先頭のアドレスを代入 */
+  initstack();
+  curvm->progp = curvm->prog; /* progが空なので先頭のアドレスを代入 */
+  curvm->indef = 0;
+  curvm->nlit = 0;
+  curvm->timing = 0; /* エラーで抜けたtime */
+  arena_reset(&curvm->stmtarena); /* 前の文の数値定数などを捨てる */
 }
 
 void push(Datum d) /* push d onto stack */
 {
-  if(stackp >= &stack[NSTACK]){
+  HocVM *vm = curvm;
+  if(vm->stackp >= &vm->stack[NSTACK]){
     execerror("stack overflow", (char *) 0);
   }
-  *stackp++ = d; /* スタックに値を追加して、ポインタを進める */
+  *vm->stackp++ = d; /* スタックに値を追加して、ポインタを進める */
 }
 
 Datum pop(void) /* pop and return top elem from stack */
 {
-  if (stackp <= stack){
+  HocVM *vm = curvm;
+  if (vm->stackp <= vm->stack){
     execerror("stack underflow", (char *) 0);
   }
-  return *--stackp; /* ポインタを戻して、スタックから値を取り出す */
+  return *--vm->stackp; /* ポインタを戻して、スタックから値を取り出す */
 }
 
 /* popは戻り値がDatumのためcode2の引数にできない
@@ -153,18 +238,25 @@ void popstack(void) /* pop and discard top elem */
 
 Inst *code(Inst f) /* install one instruction or operand */
 {
-  if(progp >= &prog[NPROG]) {
+  HocVM *vm = curvm;
+  if(vm->progp >= &vm->prog[NPROG]) {
     execerror("stack overflow", (char *) 0);
   }
-  Inst *oprogp = progp; /* 命令を書き込む前のポインタを記録 */
-  *progp++ = f; /* 命令を書き込んでポインタを進める */
+  Inst *oprogp = vm->progp; /* 命令を書き込む前のポインタを記録 */
+  *vm->progp++ = f; /* 命令を書き込んでポインタを進める */
   return oprogp; /* 命令を書き込んだ位置を返す */
 }
 
 void execute(Inst *p) /* run the machine */
 {
+  HocVM *vm = curvm;
+  int depth = ++vm->depth;
+
   for(pc = p; *pc != STOP;){
-    if (trace_enabled) {
+    if (--vm->steps < 0) { /* 命令数と時間の予算 */
+      vm_tick(vm);
+    }
+    if (vm->trace) {
       trace_instructon(pc); /* マシンを表示 */
     }
     /* 
@@ -173,68 +265,250 @@ void execute(Inst *p) /* run the machine */
      * f();
      */
     (*(*pc++))();
+    if (vm->returning) { /* 内側のwhileなどからのreturn */
+      if (vm->retdepth != depth) {
+        break;
+      }
+      vm->returning = 0;
+      pc = vm->retpc;
+    }
+  }
+  vm->depth--;
+}
+
+/*
+ * 再開できる実行 (vm_resume)
+ * executeはwhileやifの条件と本体を再帰呼び出しで実行するので、途中で止められない。
+ * resumeは同じコードを再帰せずに実行し、どの命令のどの部分を実行中かを
+ * vm->ctlに積んでおく。部分の終わりのSTOPでctlを見て次へ進む。
+ * ループを1周するところと関数を呼ぶところ (末尾呼び出しも) で vm->slice を使い切っていれば、
+ * 状態をすべてVMに残したまま戻る。次のresumeはvm->pcから続ける。
+ * 各部分の意味は whilecode, ifcode, forcode, forloop と同じ。
+ */
+enum { C_WHILE, C_WHILEBODY, C_IF, C_IFBODY, C_FOR, C_FORBODY, C_FORSTEP, C_FORLOOP };
+
+static void enter(HocVM *vm, int kind, Inst *at, Inst *p) /* run part p of the statement at at */
+{
+  if (vm->nctl >= NCTL) {
+    execerror("statements nested too deeply", (char *) 0);
+  }
+  vm->ctl[vm->nctl].kind = kind;
+  vm->ctl[vm->nctl++].at = at;
+  vm->depth++; /* executeの再帰1段に当たる */
+  pc = p;
+}
+
+int resume(HocVM *vm) /* run from pc: 0 when the statement ends, 1 if the slice ran out */
+{
+  Inst f, *w;
+  Ctl *c;
+
+  for (;;) {
+    if ((f = *pc) == STOP) {
+      if (vm->nctl == 0) {
+        return 0;
+      }
+      c = &vm->ctl[--vm->nctl];
+      vm->depth--;
+      w = c->at;
+      switch (c->kind) {
+        case C_WHILE:
+        case C_FOR:
+          if (istrue(pop())) {
+            enter(vm, c->kind == C_WHILE ? C_WHILEBODY : C_FORBODY, w, *((Inst **)w));
+          } else {
+            pc = *((Inst **)(w+1));
+          }
+          continue;
+        case C_IF:
+          if (istrue(pop())) {
+            enter(vm, C_IFBODY, w, *((Inst **)w));
+          } else if (*((Inst **)(w+1))) {
+            enter(vm, C_IFBODY, w, *((Inst **)(w+1)));
+          } else {
+            pc = *((Inst **)(w+2));
+          }
+          continue;
+        case C_IFBODY:
+          pc = *((Inst **)(w+2));
+          continue;
+        case C_FORBODY:
+          enter(vm, C_FORSTEP, w, *((Inst **)(w+2)));
+          continue;
+        case C_WHILEBODY: /* ループを1周した */
+          enter(vm, C_WHILE, w, w+2);
+          break;
+        case C_FORSTEP:
+          enter(vm, C_FOR, w, w+3);
+          break;
+        case C_FORLOOP:
+          fornext((Symbol *)w[2], (Symbol *)w[4], (long)w[6]);
+          if (--vm->steps < 0) {
+            vm_tick(vm);
+          }
+          if (fortest((Symbol *)w[2], (Symbol *)w[3], (long)w[5])) {
+            enter(vm, C_FORLOOP, w, *((Inst **)w));
+          } else {
+            pc = *((Inst **)(w+1));
+          }
+          break;
+      }
+      if (vm->slice <= 0) {
+        return 1;
+      }
+      continue;
+    }
+    if ((f == call || f == tailcall) && vm->slice <= 0) { /* 再帰だけで長く回るものもある */
+      return 1;
+    }
+    if (--vm->steps < 0) { /* 命令数と時間の予算 */
+      vm_tick(vm);
+    }
+    if (vm->trace) {
+      trace_instructon(pc);
+    }
+    vm->slice--;
+    w = pc + 1;
+    if (f == whilecode) {
+      enter(vm, C_WHILE, w, w+2);
+    } else if (f == ifcode) {
+      enter(vm, C_IF, w, w+3);
+    } else if (f == forcode) {
+      enter(vm, C_FOR, w, w+3);
+    } else if (f == forloop) {
+      if (fortest((Symbol *)w[2], (Symbol *)w[3], (long)w[5])) {
+        enter(vm, C_FORLOOP, w, *((Inst **)w));
+      } else {
+        pc = *((Inst **)(w+1));
+      }
+    } else {
+      pc = w;
+      (*f)();
+      if (vm->returning) { /* 呼び出したときの深さまで部分を捨てる */
+        while (vm->depth > vm->retdepth) {
+          vm->nctl--;
+          vm->depth--;
+        }
+        vm->returning = 0;
+        pc = vm->retpc;
+      }
+    }
   }
 }
 
 void constpush(void) /* push constant onto stack */
 {
-  Datum d;
-  d.val = ((Symbol *)*pc++)->u.val;
-  push(d);
+  push(((Symbol *)*pc++)->u.v);
 }
 
 void varpush(void) /* push variable onto stack */
 {
-  Datum d;
-  d.sym = (Symbol *)(*pc++);
-  push(d);
+  push(mksym((Symbol *)(*pc++)));
 }
 
-void add(void) /* add top two elem on stack */
+/*
+ * 四則演算
+ * 両方が整数なら整数のまま計算し、48ビットに収まらなければdoubleにする。
+ * 結果が0になる乗除算は -0 を区別するためdoubleで計算する。
+ */
+Datum addv(Datum a, Datum b)
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val += d2.val;
-  push(d1);
+  if (ISINT(a) && ISINT(b)) {
+    return mkinteger(INTVAL(a) + INTVAL(b));
+  }
+  return mknum(num(a) + num(b));
 }
 
-void sub(void) /* subtract top two elem on stack */
+Datum subv(Datum a, Datum b)
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val -= d2.val;
-  push(d1);
+  if (ISINT(a) && ISINT(b)) {
+    return mkinteger(INTVAL(a) - INTVAL(b));
+  }
+  return mknum(num(a) - num(b));
 }
 
-void mul(void) /* multiply top to elem on stack */
+Datum mulv(Datum a, Datum b)
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val *= d2.val;
-  push(d1);
+  int64_t r;
+
+  if (ISINT(a) && ISINT(b) && !__builtin_mul_overflow(INTVAL(a), INTVAL(b), &r) && r != 0) {
+    return mkinteger(r);
+  }
+  return mknum(num(a) * num(b));
 }
 
-void divide(void)
+Datum divv(Datum a, Datum b)
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  if (d2.val == 0.0){
+  if (num(b) == 0.0){
     execerror("division by zero", (char *) 0);
   }
-  d1.val /= d2.val;
-  push(d1);
+  if (ISINT(a) && ISINT(b) && INTVAL(a) != 0 && INTVAL(a) % INTVAL(b) == 0) {
+    return mkinteger(INTVAL(a) / INTVAL(b)); /* 割り切れるときだけ整数 */
+  }
+  return mknum(num(a) / num(b));
+}
+
+/*
+ * 2項演算の命令 hoc.hのBINOPSから作る
+ *   add      スタックの2つの値をとる
+ *   add_k    右の値は命令に続く定数 constpushを1つ省ける
+ */
+#define BINOP(name, expr, swapped) \
+void name(void) \
+{ \
+  Datum a, b; \
+  b = pop(); \
+  a = pop(); \
+  push(expr); \
+} \
+\
+void name##_k(void) \
+{ \
+  Datum a, b; \
+  b = ((Symbol *)*pc++)->u.v; \
+  a = pop(); \
+  push(expr); \
+}
+
+BINOPS(BINOP)
+
+Datum negv(Datum d)
+{
+  if (ISINT(d) && INTVAL(d) != 0) {
+    return mkinteger(-INTVAL(d));
+  }
+  return mknum(-num(d));
+}
+
+Datum powv(Datum d1, Datum d2)
+{
+  int64_t r, b, e;
+
+  if (ISINT(d1) && ISINT(d2) && INTVAL(d2) >= 0 && INTVAL(d2) < 64) {
+    /* 小さな整数のべき乗は掛け算で。あふれたらpowに任せる */
+    for (r = 1, b = INTVAL(d1), e = INTVAL(d2); e > 0; e--) {
+      if (__builtin_mul_overflow(r, b, &r) || !FITS48(r)) {
+        break;
+      }
+    }
+    if (e == 0 && r != 0) {
+      return mkint(r);
+    }
+  }
+  return mknum(pow(num(d1), num(d2)));
+}
+
+Datum bltinv(double (*f)(), Datum d) /* built-in f applied to d */
+{
+  if (f == integer) {
+    return ISINT(d) ? d : mkvalue(integer(num(d))); /* int()の結果は整数で持つ */
+  }
+  return mknum((*f)(num(d)));
 }
 
 void negate(void) /* negate top of stack */
 {
-  Datum d;
-  d = pop();
-  d.val = -d.val;
-  push(d);
+  push(negv(pop()));
 }
 
 void power(void) /* power */
@@ -242,246 +516,408 @@ void power(void) /* power */
   Datum d1, d2;
   d2 = pop();
   d1 = pop();
-  d1.val = pow(d1.val, d2.val);
-  push(d1);
+  push(powv(d1, d2));
 }
 
-void eval(void) /* 変数シンボルを実際の値に変換する */
+static Datum value(Symbol *sp) /* value of variable sp */
 {
-  Datum d;
-  d = pop(); /* スタックから変数シンボルを取得 */
-  if (d.sym->type == UNDEF){
-    execerror("undefined variable", d.sym->name);
+  if (sp->type == UNDEF){
+    execerror("undefined variable", sp->name);
   }
-  d.val = d.sym->u.val; /* シンボルから値を取り出す */
-  push(d); /* 値をスタックにpush */
+  if (curvm->reading) { /* 導出変数の計算中 */
+    depend(sp);
+  }
+  if (sp->type == DERIVED) {
+    return derivedval(sp);
+  }
+  if (sp->type == ARRAY) {
+    execerror("array used without subscript: ", sp->name);
+  }
+  return sp->u.v; /* シンボルから値を取り出す */
+}
+
+void eval(void) /* 変数シンボルを実際の値に変換する */
+{
+  push(value(SYM(pop()))); /* スタックから変数シンボルを取得 */
 }
 
 void assign(void) /* assign top value to next value */
 {
-  Datum d1, d2;
-  d1 = pop();
+  Symbol *sp;
+  Datum d2;
+  sp = SYM(pop());
   d2 = pop();
-  if (d1.sym->type != VAR && d1.sym->type != UNDEF){
-    execerror("assignment to non-variable", d1.sym->name);
+  if (sp->type != VAR && sp->type != UNDEF){
+    execerror("assignment to non-variable", sp->name);
   }
-  d1.sym->u.val = d2.val;
-  d1.sym->type =  VAR;
+  sp->u.v = d2;
+  sp->type =  VAR;
+  changed(sp);
   push(d2);
 }
 
 void addeq()
 {
-  Datum d1, d2;
-  d1 = pop();
+  Symbol *sp;
+  Datum d2;
+  sp = SYM(pop());
   d2 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use += on undefined variable", d1.sym->name);
+  if (sp->type != VAR){
+    execerror("cannot use += on undefined variable", sp->name);
   }
-  d2.val = d1.sym->u.val + d2.val;
-  d1.sym->u.val = d2.val; // 加算代入される変数の値を更新
-  push(d2);
+  sp->u.v = addv(sp->u.v, d2); // 加算代入される変数の値を更新
+  changed(sp);
+  push(sp->u.v);
 }
 
 void subeq()
 {
-  Datum d1, d2;
-  d1 = pop();
+  Symbol *sp;
+  Datum d2;
+  sp = SYM(pop());
   d2 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use -= on undefined variable", d1.sym->name);
+  if (sp->type != VAR){
+    execerror("cannot use -= on undefined variable", sp->name);
   }
-  d2.val = d1.sym->u.val - d2.val;
-  d1.sym->u.val = d2.val;
-  push(d2);
+  sp->u.v = subv(sp->u.v, d2);
+  changed(sp);
+  push(sp->u.v);
 }
 
 void muleq()
 {
-  Datum d1, d2;
-  d1 = pop();
+  Symbol *sp;
+  Datum d2;
+  sp = SYM(pop());
   d2 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use *= on undefined variable", d1.sym->name);
+  if (sp->type != VAR){
+    execerror("cannot use *= on undefined variable", sp->name);
   }
-  d2.val = d1.sym->u.val * d2.val;
-  d1.sym->u.val = d2.val;
-  push(d2);
+  sp->u.v = mulv(sp->u.v, d2);
+  changed(sp);
+  push(sp->u.v);
 }
 
 void diveq()
 {
-  Datum d1, d2;
-  d1 = pop();
+  Symbol *sp;
+  Datum d2;
+  sp = SYM(pop());
   d2 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use /= on undefined variable", d1.sym->name);
+  if (sp->type != VAR){
+    execerror("cannot use /= on undefined variable", sp->name);
   }
-  if (d2.val == 0.0){
-    execerror("division by zero", (char *) 0);
-  }
-  d2.val = d1.sym->u.val / d2.val;
-  d1.sym->u.val = d2.val;
-  push(d2);
+  sp->u.v = divv(sp->u.v, d2);
+  changed(sp);
+  push(sp->u.v);
 }
 
 void pre_increment()
 {
-  Datum d1;
-  d1 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use ++ on undefined variable", d1.sym->name);
+  Symbol *sp;
+  sp = SYM(pop());
+  if (sp->type != VAR){
+    execerror("cannot use ++ on undefined variable", sp->name);
   }
-  d1.sym->u.val += 1;
-  Datum d2 = {.val = d1.sym->u.val};
-  push(d2);
+  sp->u.v = addv(sp->u.v, mkint(1));
+  changed(sp);
+  push(sp->u.v);
 }
 
 void post_increment()
 {
-  Datum d1;
-  d1 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use ++ on undefined variable", d1.sym->name);
+  Symbol *sp;
+  sp = SYM(pop());
+  if (sp->type != VAR){
+    execerror("cannot use ++ on undefined variable", sp->name);
   }
-  Datum d2 = {.val = d1.sym->u.val};
-  push(d2);
-  d1.sym->u.val += 1;
+  push(sp->u.v);
+  sp->u.v = addv(sp->u.v, mkint(1));
+  changed(sp);
 }
 
 void pre_decrement()
 {
-  Datum d1;
-  d1 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use -- on undefined variable", d1.sym->name);
+  Symbol *sp;
+  sp = SYM(pop());
+  if (sp->type != VAR){
+    execerror("cannot use -- on undefined variable", sp->name);
   }
-  d1.sym->u.val -= 1;
-  Datum d2 = {.val = d1.sym->u.val};
-  push(d2);
+  sp->u.v = subv(sp->u.v, mkint(1));
+  changed(sp);
+  push(sp->u.v);
 }
 
 void post_decrement()
 {
-  Datum d1;
-  d1 = pop();
-  if (d1.sym->type != VAR){
-    execerror("cannot use -- on undefined variable", d1.sym->name);
+  Symbol *sp;
+  sp = SYM(pop());
+  if (sp->type != VAR){
+    execerror("cannot use -- on undefined variable", sp->name);
   }
-  Datum d2 = {.val = d1.sym->u.val};
-  push(d2);
-  d1.sym->u.val -= 1;
+  push(sp->u.v);
+  sp->u.v = subv(sp->u.v, mkint(1));
+  changed(sp);
 }
 
 void print(void) /* pop top value from stack, print it */
 {
   Datum d;
   d = pop();
-  printf("\t%.8g\n", d.val);
+  fprintf(curvm->fout, "\t%.8g\n", num(d));
 }
 
 void bltin(void) /* evaluate built-in on top of stack */
 {
-  Datum d;
-  d = pop();
-  d.val = (*(double (*)())(*pc++))(d.val);
-  push(d);
+  double (*f)() = (double (*)())(*pc++);
+  push(bltinv(f, pop()));
 }
 
-void le() /* less than or qeual to */
-{ 
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val <= d2.val);
-  push(d1);
-}
-
-void ge() /* greater than or qeual to */
-{ 
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val >= d2.val);
-  push(d1);
+void andcode(void) /* && : skip right operand if left is false */
+{
+  if (!istrue(pop())) {
+    push(mkbool(0));
+    pc = *((Inst **)pc); /* 結果は0 */
+  } else {
+    pc++; /* 右のオペランドへ */
+  }
 }
 
-void gt() /* greater than */
+void orcode(void) /* || : skip right operand if left is true */
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val > d2.val);
-  push(d1);
+  if (istrue(pop())) {
+    push(mkbool(1));
+    pc = *((Inst **)pc); /* 結果は1 */
+  } else {
+    pc++;
+  }
 }
 
-void lt() /* less than */
+void truth(void) /* value of right operand of && or || as 0 or 1 */
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val < d2.val);
-  push(d1);
+  push(mkbool(istrue(pop())));
 }
 
-void eq() /* equale to */
+void not() /* not */
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val == d2.val);
-  push(d1);
+  push(mkbool(!istrue(pop())));
 }
 
-void ne() /* not equale */
+void whilecode()
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val != d2.val);
-  push(d1);
+  Datum d;
+  Inst *savepc = pc; /* loop body */
+  execute(savepc+2); /* condition */
+  d = pop();
+  while (istrue(d)){
+    execute(*((Inst **)(savepc))); /* body */
+    if (curvm->returning) {
+      return;
+    }
+    execute(savepc+2);
+    d = pop();
+  }
+  pc = *((Inst **)(savepc+1)); /* next statement */
 }
 
-void and() /* and */
+/*
+ * time stmt
+ *   [n]   timecode
+ *   [n+1] 本体へのポインタ
+ *   [n+2] 次の文へのポインタ
+ *   [n+3] 本体 STOP
+ * 本体の実行にかかった時間、実行した命令数、スタックの最高位置をferrに出す。
+ * スタックの空いているところを印で埋めておき、あとで印の消えたところを探すので、
+ * pushは何もしなくてよい。入れ子のtimeは自分が見た最高位置を外側に渡す。
+ */
+#define PAINT 0xFFFFDEADDEADDEADULL /* NaN boxingで作られることのない値 */
+
+static Datum *stacktop(HocVM *vm, Datum *base) /* one past the highest slot written since painting */
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val && d2.val);
-  push(d1);
+  Datum *p = &vm->stack[NSTACK];
+
+  while (p > base && p[-1].bits == PAINT) {
+    p--;
+  }
+  return p;
 }
 
-void or() /* or */
+void timecode(void)
 {
-  Datum d1, d2;
-  d2 = pop();
-  d1 = pop();
-  d1.val = (double)(d1.val || d2.val);
-  push(d1);
+  HocVM *vm = curvm;
+  Inst *savepc = pc;
+  Datum *base = vm->stackp, *outer = vm->stackhigh, *top, *p;
+  long insts = vm_insts(vm);
+  double t = vm_clock();
+
+  if (vm->timing && (top = stacktop(vm, base)) > outer) { /* 外側のtimeのここまでの分 */
+    outer = top;
+  }
+  for (p = base; p < &vm->stack[NSTACK]; p++) {
+    p->bits = PAINT;
+  }
+  vm->timing++;
+  vm->stackhigh = base;
+  execute(*((Inst **)(savepc))); /* body */
+  vm->timing--;
+  t = vm_clock() - t;
+  insts = vm_insts(vm) - insts;
+  if ((top = stacktop(vm, base)) < vm->stackhigh) { /* 内側のtimeが見た分 */
+    top = vm->stackhigh;
+  }
+  vm->stackhigh = top > outer ? top : outer;
+  fprintf(vm->ferr, "time: %.6f s, %ld instructions, stack %ld\n", t, insts, (long)(top - vm->stack));
+  if (vm->returning) {
+    return;
+  }
+  pc = *((Inst **)(savepc+1)); /* next statement */
 }
 
-void not() /* not */
+/*
+ * for (init; cond; step) stmt
+ *   init popstack
+ *   [n]   forcode
+ *   [n+1] 本体へのポインタ
+ *   [n+2] 次の文へのポインタ
+ *   [n+3] stepへのポインタ
+ *   [n+4] 条件式 STOP, step popstack STOP, 本体 STOP
+ * 条件が  i < n  (<=, >, >=, != でもよい nは変数か定数)  で、stepが  i++, i--,
+ * i += 定数, i = i + 定数  などの数え上げのループは、forfuseでforloopに書き換える。
+ *   [n]   forloop
+ *   [n+1] 本体へのポインタ
+ *   [n+2] 次の文へのポインタ
+ *   [n+3] i, n, 増分 (シンボル)
+ *   [n+6] 比較の種類, 減らすか
+ *   [n+8] 本体 STOP
+ * forloopは増分と比較と分岐を1命令で行う。iは回るたびに一度だけ読み、
+ * 本体がiを書き換えてもよい。
+ */
+void forcode(void)
 {
   Datum d;
+  Inst *savepc = pc;
+  execute(savepc+3); /* condition */
   d = pop();
-  d.val = (double)(!d.val);
-  push(d);
+  while (istrue(d)) {
+    execute(*((Inst **)(savepc))); /* body */
+    if (curvm->returning) {
+      return;
+    }
+    execute(*((Inst **)(savepc+2))); /* step */
+    execute(savepc+3);
+    d = pop();
+  }
+  pc = *((Inst **)(savepc+1)); /* next statement */
 }
 
-void whilecode()
+static Inst forcmp[] = { lt, le, gt, ge, ne, 0 };
+static Inst forcmp_k[] = { lt_k, le_k, gt_k, ge_k, ne_k, 0 };
+
+static int forindex(Inst f, Inst *tab)
 {
-  Datum d;
-  Inst *savepc = pc; /* loop body */
-  execute(savepc+2); /* condition */
-  d = pop();
-  while (d.val){
+  int i;
+
+  for (i = 0; tab[i] && tab[i] != f; i++) {
+  }
+  return tab[i] ? i : -1;
+}
+
+int fortest(Symbol *i, Symbol *lim, int cmp) /* condition of forloop */
+{
+  Datum a, b;
+
+  a = value(i);
+  b = lim->type == NUMBER ? lim->u.v : value(lim);
+  switch (cmp) {
+    case 0: return COMPARE(a, <, b);
+    case 1: return COMPARE(a, <=, b);
+    case 2: return COMPARE(a, >, b);
+    case 3: return COMPARE(a, >=, b);
+    default: return COMPARE(a, !=, b);
+  }
+}
+
+void fornext(Symbol *i, Symbol *inc, int down) /* step of forloop */
+{
+  if (i->type != VAR) {
+    execerror("assignment to non-variable", i->name);
+  }
+  i->u.v = down ? subv(i->u.v, inc->u.v) : addv(i->u.v, inc->u.v);
+  changed(i);
+}
+
+void forloop(void)
+{
+  HocVM *vm = curvm;
+  Inst *savepc = pc;
+  Symbol *i = (Symbol *)savepc[2], *lim = (Symbol *)savepc[3], *inc = (Symbol *)savepc[4];
+  int cmp = (long)savepc[5], down = (long)savepc[6];
+
+  while (fortest(i, lim, cmp)) {
     execute(*((Inst **)(savepc))); /* body */
-    execute(savepc+2);
-    d = pop();
+    if (vm->returning) {
+      return;
+    }
+    fornext(i, inc, down);
+    if (--vm->steps < 0) { /* 本体が空でも予算を減らす */
+      vm_tick(vm);
+    }
   }
   pc = *((Inst **)(savepc+1)); /* next statement */
 }
 
+void forfuse(Inst *f) /* make the for loop at f, the last code generated, a forloop */
+{
+  HocVM *vm = curvm;
+  Inst *c = f + 4, *s = (Inst *)f[3], *body = (Inst *)f[1], *next = (Inst *)f[2], *tmp;
+  Symbol *i, *lim, *inc;
+  int cmp, down, n;
+
+  if (next != vm->progp || c[0] != varpush || c[2] != eval) {
+    return;
+  }
+  i = (Symbol *)c[1];
+  if (i->type != VAR && i->type != UNDEF) {
+    return;
+  }
+  if ((cmp = forindex(c[3], forcmp_k)) >= 0 && c[5] == STOP) { /* i < 定数 */
+    lim = (Symbol *)c[4];
+  } else if (c[3] == varpush && c[5] == eval && (cmp = forindex(c[6], forcmp)) >= 0 && c[7] == STOP) {
+    lim = (Symbol *)c[4];
+  } else {
+    return;
+  }
+  if (s[0] == varpush && (Symbol *)s[1] == i && s[3] == popstack && s[4] == STOP &&
+      (s[2] == post_increment || s[2] == pre_increment || s[2] == post_decrement || s[2] == pre_decrement)) {
+    inc = constsym(1.0);
+    down = s[2] == post_decrement || s[2] == pre_decrement;
+  } else if (s[0] == constpush && s[2] == varpush && (Symbol *)s[3] == i &&
+      (s[4] == addeq || s[4] == subeq) && s[5] == popstack && s[6] == STOP) { /* i += 定数 */
+    inc = (Symbol *)s[1];
+    down = s[4] == subeq;
+  } else if (s[0] == varpush && (Symbol *)s[1] == i && s[2] == eval && (s[3] == add_k || s[3] == sub_k) &&
+      s[5] == varpush && (Symbol *)s[6] == i && s[7] == assign && s[8] == popstack && s[9] == STOP) {
+    inc = (Symbol *)s[4]; /* i = i + 定数 */
+    down = s[3] == sub_k;
+  } else {
+    return;
+  }
+  /* 本体を条件式とstepのあった所へ詰める */
+  n = next - body;
+  tmp = (Inst *)ctalloc(n * sizeof(Inst));
+  codecopy(tmp, body, next, 0, 0);
+  f[0] = forloop;
+  f[3] = (Inst)i;
+  f[4] = (Inst)lim;
+  f[5] = (Inst)inc;
+  f[6] = (Inst)(long)cmp;
+  f[7] = (Inst)(long)down;
+  codecopy(f + 8, tmp, tmp + n, 0, 0);
+  f[1] = (Inst)(f + 8);
+  f[2] = (Inst)(f + 8 + n);
+  vm->progp = f + 8 + n;
+}
+
 void ifcode()
 {
   /*
@@ -495,12 +931,15 @@ void ifcode()
   Inst *savepc = pc; /* executeでインクリメント済みなのでこれがthen部分を指している */
   execute(savepc+3); /* if文の条件式を実行 */
   d = pop(); /* 条件式の結果を取得 */
-  if (d.val) {
+  if (istrue(d)) {
     execute(*((Inst **)(savepc))); /* then部分を実行 */
   }
   else if (*((Inst **)(savepc+1))) { /* else part? */
     execute(*((Inst **)(savepc+1))); /* else部分を実行 */
   }
+  if (curvm->returning) {
+    return;
+  }
   pc = *((Inst **)(savepc+2)); /* next stmt */
 }
 
@@ -508,6 +947,279 @@ void prexpr() /* print numeric value */
 {
   Datum d;
   d = pop();
-  printf("%.8g\n", d.val);
+  fprintf(curvm->fout, "%.8g\n", num(d));
+}
+
+
+/*
+ * 関数と手続き
+ *
+ * 本体は定義のときにprogの外(変数と同じ領域)へ移すので、initcodeで消えない。
+ * 呼び出しはフレームを積んでpcを本体へ移すだけで、executeを再帰呼び出ししない。
+ * whileやifの中からreturnしたときは、呼び出したときのexecuteの深さまで戻ってから
+ * 続ける (vm->returning)。
+ */
+
+static void jump(Inst *p, int depth) /* continue at p in execute() level depth */
+{
+  HocVM *vm = curvm;
+  if (vm->depth == depth) {
+    pc = p;
+  } else {
+    vm->returning = 1;
+    vm->retdepth = depth;
+    vm->retpc = p;
+  }
+}
+
+static Func *function(Symbol *sp)
+{
+  if (sp->type != FUNCTION && sp->type != PROCEDURE) {
+    execerror(sp->name, " not a function");
+  }
+  if (sp->u.fn == 0) {
+    execerror(sp->name, " undefined function");
+  }
+  return sp->u.fn;
+}
+
+void call(void) /* call a function */
+{
+  HocVM *vm = curvm;
+  Symbol *sp = (Symbol *)pc[0];
+  Func *fn = function(sp);
+  Frame *f;
+
+  if (vm->fp >= &vm->frame[NFRAME-1]) {
+    execerror(sp->name, " call nested too deeply");
+  }
+  f = ++vm->fp;
+  f->sp = sp;
+  f->nargs = (long)pc[1];
+  f->args = vm->stackp - f->nargs;
+  f->retpc = pc + 2;
+  f->depth = vm->depth;
+  pc = fn->code;
+}
+
+void tailcall(void) /* return f(...): reuse the current frame */
+{
+  HocVM *vm = curvm;
+  Symbol *sp = (Symbol *)pc[0];
+  Func *fn = function(sp);
+  Frame *f = vm->fp;
+  int i, nargs = (long)pc[1];
+
+  if (f == vm->frame) {
+    execerror("return from outside a function", (char *) 0);
+  }
+  if (f->sp->type == PROCEDURE) { /* funcretと同じ フレームを使い回す前に調べる */
+    execerror(f->sp->name, " (proc) returns value");
+  }
+  for (i = 0; i < nargs; i++) { /* 新しい引数を古い引数の位置へ移す */
+    f->args[i] = vm->stackp[i - nargs];
+  }
+  vm->stackp = f->args + nargs;
+  f->sp = sp;
+  f->nargs = nargs;
+  jump(fn->code, f->depth);
+}
+
+static void ret(void) /* common return from func or proc */
+{
+  HocVM *vm = curvm;
+  Frame *f = vm->fp;
+
+  if (f == vm->frame) {
+    execerror("return from outside a function", (char *) 0);
+  }
+  vm->stackp = f->args; /* pop arguments */
+  vm->fp--;
+  jump(f->retpc, f->depth);
+}
+
+void funcret(void) /* return from a function */
+{
+  Datum d;
+  if (curvm->fp->sp->type == PROCEDURE) {
+    execerror(curvm->fp->sp->name, " (proc) returns value");
+  }
+  d = pop(); /* preserve function return value */
+  ret();
+  push(d);
+}
+
+void procret(void) /* return from a procedure */
+{
+  if (curvm->fp->sp->type == FUNCTION) {
+    execerror(curvm->fp->sp->name, " (func) returns no value");
+  }
+  ret();
+}
+
+static Datum *getarg(void) /* return pointer to argument */
+{
+  HocVM *vm = curvm;
+  int n = (long)*pc++;
+
+  if (vm->fp == vm->frame) {
+    execerror("$ used outside a function", (char *) 0);
+  }
+  if (n < 1 || n > vm->fp->nargs) {
+    execerror(vm->fp->sp->name, " not enough arguments");
+  }
+  return &vm->fp->args[n - 1];
+}
+
+void arg(void) /* push argument onto stack */
+{
+  push(*getarg());
+}
+
+void argassign(void) /* store top of stack in argument */
+{
+  Datum d;
+  d = pop();
+  push(d); /* leave value on stack */
+  *getarg() = d;
+}
+
+void argstore(void) /* pop into the hidden variable of an inlined argument */
+{
+  Symbol *sp = (Symbol *)*pc++;
+  sp->u.v = pop();
 }
 
+void tmpval(void) /* push value of a hidden variable */
+{
+  push(((Symbol *)*pc++)->u.v);
+}
+
+static int inlinable(Inst *p, Inst *end, int *nargs) /* body is "return expr" with a plain expression */
+{
+  static Inst ok[] = {
+#define BINOP_OK(name, expr, swapped) name, name##_k,
+    BINOPS(BINOP_OK)
+    constpush, varpush, eval, negate, power, bltin,
+    andcode, orcode, truth, not, arg, duptop, 0
+  };
+  int i;
+
+  *nargs = 0;
+  if (end - p < 2 || end - p - 2 > NINLINE || end[-2] != funcret || end[-1] != procret) {
+    return 0;
+  }
+  for (end -= 2; p < end; p += inst_len(p)) {
+    for (i = 0; ok[i] && ok[i] != *p; i++) {
+    }
+    if (ok[i] == 0) {
+      return 0;
+    }
+    if (*p == arg) {
+      long n = (long)p[1];
+      if (n < 1 || n > NINLINEARG) {
+        return 0;
+      }
+      if (n > *nargs) {
+        *nargs = n;
+      }
+    }
+  }
+  return 1;
+}
+
+void define(Symbol *sp, Inst *start) /* move the body [start, progp) out of prog */
+{
+  HocVM *vm = curvm;
+  int i, n;
+  Func *fn;
+
+  vm->ndefs++;
+  optimize(start);
+  n = vm->progp - start;
+  fn = (Func *)arena_alloc(&vm->symarena, sizeof(Func));
+  fn->code = (Inst *)arena_alloc(&vm->symarena, n * sizeof(Inst));
+  codecopy(fn->code, start, vm->progp, 0, 0);
+  fn->len = n;
+  fn->ninline = 0;
+  if (sp->type == FUNCTION && inlinable(fn->code, fn->code + n, &fn->nargs)) {
+    fn->ninline = n - 2;
+    for (i = 0; i < fn->nargs; i++) {
+      fn->tmp[i] = (Symbol *)arena_alloc(&vm->symarena, sizeof(Symbol));
+      fn->tmp[i]->name = "$";
+      fn->tmp[i]->type = VAR;
+      fn->tmp[i]->u.v = mkint(0);
+      fn->tmp[i]->users = 0;
+      fn->tmp[i]->next = 0;
+    }
+  }
+  sp->u.fn = fn;
+  vm->progp = start; /* progは次の文のために空ける */
+}
+
+/*
+ * 展開したコードは呼んだ関数を定義し直しても変わらない。
+ * 文のコードは毎回作り直すか、定義が変わればキャッシュから捨てるのでよいが、
+ * 関数や導出変数の本体は残るので展開せずに call を置く。
+ */
+Inst *callcode(Symbol *sp, int nargs) /* generate a call, inlining small functions */
+{
+  HocVM *vm = curvm;
+  Func *fn = sp->type == FUNCTION ? sp->u.fn : 0;
+  Inst *start = vm->progp, *p;
+  int i;
+
+  if (fn == 0 || fn->ninline == 0 || fn->nargs != nargs || vm->indef || vm->persist) {
+    code(call);
+    code((Inst)sp);
+    code((Inst)(long)nargs);
+    return start;
+  }
+  for (i = nargs; i > 0; i--) { /* 引数は後ろから隠れ変数へ */
+    code(argstore);
+    code((Inst)fn->tmp[i-1]);
+  }
+  if (vm->progp + fn->ninline >= &vm->prog[NPROG]) {
+    execerror("program too big", (char *) 0);
+  }
+  codecopy(vm->progp, fn->code, fn->code + fn->ninline, 0, 0);
+  for (p = vm->progp; p < vm->progp + fn->ninline; p += inst_len(p)) {
+    if (*p == arg) {
+      p[0] = tmpval;
+      p[1] = (Inst)fn->tmp[(long)p[1] - 1];
+    }
+  }
+  vm->progp += fn->ninline;
+  return start;
+}
+
+static struct {
+  Inst op, op_k;
+  Inst swapped;    /* c op x == x swapped c */
+} binops[] = {
+#define BINOP_CODE(name, expr, swapped) {name, name##_k, swapped},
+  BINOPS(BINOP_CODE)
+  {0, 0, 0}
+};
+
+void binopcode(Inst *left, Inst *right, Inst op) /* generate left op right */
+{
+  HocVM *vm = curvm;
+  Symbol *c;
+  int i;
+
+  for (i = 0; binops[i].op != op; i++) {
+  }
+  if (right == vm->progp - 2 && right[0] == constpush) { /* x op 定数 */
+    right[0] = binops[i].op_k;
+  } else if (binops[i].swapped && right - left == 2 && left[0] == constpush) {
+    /* 定数 op x は左右を入れ替える 定数の評価は副作用がないので順番を変えてよい */
+    c = (Symbol *)left[1];
+    codecopy(left, right, vm->progp, 0, 0);
+    vm->progp -= 2;
+    code(binops[i].swapped);
+    code((Inst)c);
+  } else {
+    code(op);
+  }
+}
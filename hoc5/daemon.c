@@ -0,0 +1,489 @@
+#define _GNU_SOURCE /* accept4 */
+#include "hoc.h"
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * hocd: 評価デーモン  hoc5 -d socket
+ *
+ * Unixドメインソケットで待ち受け、epollで全部の接続を1つのスレッドで扱う。
+ * 接続ごとにVMを1つ作るので、変数や関数は同じ接続の次のリクエストでも使える。
+ *
+ * リクエストは "." だけの行で終わるプログラムで、返事は print などの出力と
+ * エラーメッセージのあとに "." だけの行を付けたもの。
+ *   x = 2          -->
+ *   x * 3                6
+ *   .                    .
+ *
+ * 翻訳したコードは接続ごとに、ソースのハッシュをキーにしてキャッシュする。
+ * 関数や導出変数を定義すると、インライン展開したコードなどが古くなるので
+ * キャッシュを全部捨てる。定義を含むリクエストは、あとの定義が前の文に
+ * 効かないよう、hoc5 < prog と同じく1文ずつ翻訳しては実行し、キャッシュしない。
+ * 1リクエストの実行には命令数と時間の予算があり、超えるとエラーで打ち切る。
+ * 遅いリクエストがほかの接続を待たせないよう、リクエストはQUOTA命令ずつ
+ * 順番に実行し、その合間にepollに戻る。時間の予算はそのリクエストを実行して
+ * いた時間だけを数える。ただし parallel for は終わるまでループを止める。
+ * save, restore, load, mapfile はデーモンのファイルを触れるので使えない。
+ * parallel for のスレッドはプロセスに1組で、全部の接続が順に使う。
+ */
+
+#define NCACHE   64        /* programs cached per connection */
+#define MAXREQ   (1 << 20) /* longest request */
+#define MAXOUT   (1 << 20) /* stop reading while this much output is unsent */
+#define NEVENT   64
+#define QUOTA    100000    /* instructions run before the next connection's turn */
+
+typedef struct Program {
+  uint64_t hash;   /* 0: empty slot */
+  char *src;
+  size_t len;
+  Inst *code, *end;
+} Program;
+
+typedef struct Conn {
+  int fd;
+  HocVM *vm;
+  char *in;          /* 受け取ったまだ実行していないリクエスト */
+  size_t inlen, insize;
+  char *out;         /* 送り切れていない返事 */
+  size_t outlen, outoff, outsize;
+  Program cache[NCACHE];
+  int ncached;       /* cachearenaを捨てるまでに入れた数 */
+  long ndefs;        /* キャッシュしたときのvm->ndefs */
+  Arena cachearena;  /* キャッシュしたコードと定数 */
+  int events;        /* epollに登録しているイベント */
+  int eof;           /* 相手が送り終えた 返事を送り切ったら閉じる */
+  int busy;          /* リクエストを実行している途中 */
+  int stepwise;      /* 定義を含むので1文ずつ翻訳する */
+  char *src;         /* 実行中のリクエスト */
+  Inst *next, *end;  /* 次に実行するコード */
+  double left;       /* 残りの時間の予算 */
+  FILE *rout;        /* 実行中のリクエストの返事 */
+  char *rbuf;
+  size_t rlen;
+  int queued;        /* runqに入っている */
+  struct Conn *nextrun;
+} Conn;
+
+static Conn *runq, **runqtail = &runq; /* 実行の続きがある接続 */
+static int epfd;
+static long maxinsts;
+static double maxsecs;
+
+static Conn *newconn(int fd)
+{
+  Conn *c = (Conn *)calloc(1, sizeof(Conn));
+
+  if (c == 0 || (c->vm = vm_create()) == 0) {
+    free(c);
+    return 0;
+  }
+  c->fd = fd;
+  c->vm->trace = 0;
+  c->vm->nofiles = 1; /* クライアントにファイルを読み書きさせない */
+  arena_init(&c->cachearena, 16384);
+  return c;
+}
+
+static void closeconn(Conn *c)
+{
+  Conn **pp;
+
+  for (pp = &runq; c->queued && *pp != 0; pp = &(*pp)->nextrun) {
+    if (*pp == c) {
+      if ((*pp = c->nextrun) == 0) {
+        runqtail = pp;
+      }
+      break;
+    }
+  }
+  if (c->busy) {
+    fclose(c->rout);
+    free(c->rbuf);
+    free(c->src);
+  }
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, 0);
+  close(c->fd);
+  vm_free(c->vm);
+  arena_free(&c->cachearena);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+static void clearcache(Conn *c)
+{
+  memset(c->cache, 0, sizeof(c->cache));
+  c->ncached = 0;
+  c->ndefs = c->vm->ndefs;
+  arena_reset(&c->cachearena);
+}
+
+static int hasdefs(const char *s) /* s defines a function, procedure or derived variable */
+{
+  const char *p;
+  char *q;
+
+  for (; *s; s++) { /* yylexと同じように字句に分ける */
+    if (*s == '"') {
+      while (s[1] && s[1] != '"' && s[1] != '\n') {
+        s++;
+      }
+      if (s[1]) { /* 閉じる " */
+        s++;
+      }
+    } else if (isalpha((unsigned char)*s)) {
+      for (p = s; isalnum((unsigned char)s[1]); s++) {
+      }
+      if (s - p == 3 && (strncmp(p, "func", 4) == 0 || strncmp(p, "proc", 4) == 0)) {
+        return 1;
+      }
+    } else if (*s == '.' || isdigit((unsigned char)*s)) {
+      strtod(s, &q); /* 1e5 などの文字を名前と見ない */
+      if (q > s) {
+        s = q - 1;
+      }
+    } else if (*s == ':' && s[1] == '=') {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static Program *compile(Conn *c, char *src, size_t len, uint64_t h) /* 0 if it has errors */
+{
+  HocVM *vm = c->vm;
+  Program *pg;
+  int n, r;
+
+  if (c->ncached >= NCACHE) {
+    clearcache(c);
+  }
+  vm->keep = &c->cachearena; /* 定数などをキャッシュと同じ寿命にする */
+  r = vm_compile(vm);
+  vm->keep = 0;
+  if (r < 0) {
+    return 0;
+  }
+  pg = &c->cache[h % NCACHE];
+  n = vm->progp - vm->prog;
+  pg->hash = h;
+  pg->len = len;
+  pg->src = memcpy(arena_alloc(&c->cachearena, len), src, len);
+  pg->code = (Inst *)arena_alloc(&c->cachearena, n * sizeof(Inst));
+  pg->end = pg->code + n;
+  codecopy(pg->code, vm->prog, vm->progp, 0, 0);
+  c->ncached++;
+  return pg;
+}
+
+static int start(Conn *c, const char *src, size_t len) /* begin running request src */
+{
+  HocVM *vm = c->vm;
+  uint64_t h = strhash(src, len);
+  Program *pg;
+
+  if ((c->src = malloc(len + 1)) == 0) {
+    return -1;
+  }
+  if ((c->rout = open_memstream(&c->rbuf, &c->rlen)) == 0) {
+    free(c->src);
+    return -1;
+  }
+  memcpy(c->src, src, len);
+  c->src[len] = '\0';
+  if (vm->ndefs != c->ndefs) {
+    clearcache(c);
+  }
+  vm->fout = vm->ferr = c->rout;
+  vm_load_string(vm, c->src); /* 途中で止まってもソースは残る */
+  vm_budget(vm, maxinsts, 0);
+  c->left = maxsecs;
+  c->busy = 1;
+  c->next = c->end = 0;
+  if ((c->stepwise = hasdefs(c->src)) != 0) {
+    return 0;
+  }
+  pg = &c->cache[h % NCACHE];
+  if (pg->hash == h && pg->len == len && memcmp(pg->src, src, len) == 0) {
+    fseek(vm->fin, 0, SEEK_END); /* read()はプログラムの後ろから読む */
+  } else if ((pg = compile(c, c->src, len, h)) == 0) {
+    return 0;
+  }
+  c->next = pg->code;
+  c->end = pg->end;
+  return 0;
+}
+
+static int step(Conn *c, long *quota) /* run the request for up to *quota instructions: 1 if it has more */
+{
+  HocVM *vm = c->vm;
+  double t = vm_clock();
+  int r;
+
+  if (maxsecs > 0) {
+    vm->deadline = t + c->left; /* ほかの接続を実行していた時間は数えない */
+  }
+  for (;;) {
+    if (!vm->paused && c->next >= c->end) {
+      if (!c->stepwise || vm_parse(vm) <= 0) {
+        r = 0;
+        break;
+      }
+      c->next = vm->prog;
+      c->end = vm->progp;
+    }
+    if ((r = vm_slice(vm, &c->next, c->end, *quota)) < 0) {
+      r = 0; /* エラーでリクエストを打ち切る */
+      break;
+    }
+    if ((*quota = vm->slice) <= 0) {
+      r = 1;
+      break;
+    }
+  }
+  c->left -= vm_clock() - t;
+  return r;
+}
+
+static int reply(Conn *c, const char *s, size_t n)
+{
+  if (c->outlen + n > c->outsize) {
+    size_t size = c->outsize ? c->outsize : 4096;
+    char *p;
+    while (size < c->outlen + n) {
+      size *= 2;
+    }
+    if ((p = realloc(c->out, size)) == 0) {
+      return -1;
+    }
+    c->out = p;
+    c->outsize = size;
+  }
+  memcpy(c->out + c->outlen, s, n);
+  c->outlen += n;
+  return 0;
+}
+
+static int finish(Conn *c) /* send the request's output */
+{
+  int r;
+
+  vm_budget(c->vm, 0, 0);
+  vm_load(c->vm, stdin);
+  free(c->src);
+  fputs(".\n", c->rout);
+  fclose(c->rout);
+  r = reply(c, c->rbuf, c->rlen);
+  free(c->rbuf);
+  c->busy = 0;
+  return r;
+}
+
+static char *endofrequest(char *p, char *e) /* the "." line ending a request */
+{
+  char *q;
+
+  for (; p < e && (q = memchr(p, '\n', e - p)) != 0; p = q + 1) {
+    if ((q - p == 1 && p[0] == '.') || (q - p == 2 && p[0] == '.' && p[1] == '\r')) {
+      return p;
+    }
+  }
+  return 0;
+}
+
+static int serve(Conn *c) /* run requests for a turn: 1 if they have more, 0 if all received are done */
+{
+  char *p = c->in, *e = c->in + c->inlen, *dot;
+  long quota = QUOTA;
+  int r = 0;
+
+  for (;;) {
+    if (quota <= 0) {
+      r = 1; /* 続きは次の番で */
+      break;
+    }
+    if (c->busy) {
+      if (!step(c, &quota) && finish(c) < 0) {
+        r = -1;
+        break;
+      }
+      continue;
+    }
+    if (c->outlen - c->outoff >= MAXOUT || (dot = endofrequest(p, e)) == 0) {
+      break;
+    }
+    *dot = '\0';
+    if (start(c, p, dot - p) < 0) {
+      r = -1;
+      break;
+    }
+    p = memchr(dot, '\n', e - dot) + 1;
+  }
+  c->inlen = e - p;
+  memmove(c->in, p, c->inlen);
+  return r;
+}
+
+static int flush(Conn *c) /* send as much output as the socket takes */
+{
+  ssize_t n;
+
+  while (c->outoff < c->outlen) {
+    n = write(c->fd, c->out + c->outoff, c->outlen - c->outoff);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    c->outoff += n;
+  }
+  c->outoff = c->outlen = 0;
+  return 0;
+}
+
+static int input(Conn *c) /* read what has arrived, -1 at end of file or error */
+{
+  ssize_t n;
+
+  for (;;) {
+    if (c->inlen + 1 >= c->insize) {
+      size_t size = c->insize ? 2 * c->insize : 4096;
+      char *p;
+      if (size > MAXREQ + 1 || (p = realloc(c->in, size)) == 0) {
+        return -1; /* 長すぎるリクエスト */
+      }
+      c->in = p;
+      c->insize = size;
+    }
+    n = read(c->fd, c->in + c->inlen, c->insize - c->inlen - 1); /* 1つは '\0' 用 */
+    if (n == 0) {
+      return -1;
+    }
+    if (n < 0) {
+      return errno == EAGAIN || errno == EINTR ? 0 : -1;
+    }
+    c->inlen += n;
+  }
+}
+
+static int watch(Conn *c) /* read while output is not backed up, write while any is unsent */
+{
+  struct epoll_event ev;
+
+  ev.events = 0;
+  if (!c->eof && !c->busy && c->outlen - c->outoff < MAXOUT) {
+    ev.events |= EPOLLIN;
+  }
+  if (c->outoff < c->outlen) {
+    ev.events |= EPOLLOUT;
+  }
+  if (ev.events == (uint32_t)c->events) {
+    return 0;
+  }
+  ev.data.ptr = c;
+  c->events = ev.events;
+  return epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void poke(Conn *c) /* serve c, send what it can and watch for what it waits for */
+{
+  int r;
+
+  /* 切れる前に届いたリクエストにも答える */
+  if ((r = serve(c)) < 0 || flush(c) < 0 || (r == 0 && c->eof && c->outoff == c->outlen) || watch(c) < 0) {
+    closeconn(c);
+  } else if (r > 0 && !c->queued) {
+    c->queued = 1;
+    c->nextrun = 0;
+    *runqtail = c;
+    runqtail = &c->nextrun;
+  }
+}
+
+static void accepting(int lfd)
+{
+  struct epoll_event ev;
+  Conn *c;
+  int fd;
+
+  while ((fd = accept4(lfd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    if ((c = newconn(fd)) == 0) {
+      close(fd);
+      continue;
+    }
+    ev.events = c->events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      closeconn(c);
+    }
+  }
+}
+
+int hocd(const char *path, long insts, double secs) /* serve requests on socket path */
+{
+  struct sockaddr_un addr;
+  struct epoll_event ev, evs[NEVENT];
+  Conn *c, *list;
+  int lfd, n, i;
+
+  maxinsts = insts;
+  maxsecs = secs;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket name too long\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  unlink(path);
+  if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0) {
+    perror(path);
+    return -1;
+  }
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    perror("epoll");
+    return -1;
+  }
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0; /* 待ち受けソケット */
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+  signal(SIGPIPE, SIG_IGN);
+
+  for (;;) {
+    n = epoll_wait(epfd, evs, NEVENT, runq ? 0 : -1);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      return -1;
+    }
+    for (i = 0; i < n; i++) {
+      if ((c = (Conn *)evs[i].data.ptr) == 0) {
+        accepting(lfd);
+        continue;
+      }
+      if (!c->eof && (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        c->eof = input(c) < 0;
+      }
+      if (!c->queued) {
+        poke(c);
+      } else if (flush(c) < 0 || watch(c) < 0) { /* 実行はrunqの順番で */
+        closeconn(c);
+      }
+    }
+    list = runq;
+    runq = 0;
+    runqtail = &runq;
+    while ((c = list) != 0) {
+      list = c->nextrun;
+      c->queued = 0;
+      poke(c);
+    }
+  }
+}
@@ -0,0 +1,309 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * プログラムとは別のデータ入力
+ * ファイルは丸ごとmmapし、レコード(行)の分割やフィールドの数値変換は
+ * バッファ上で直接行う（コピーしない）
+ * strtodがバッファの外を読まないよう、末尾は必ず改行で終わるようにする
+ *
+ * 列形式のバイナリも読める。レコードが行、フィールドが列になる。
+ *   "HOCCOL1\n"                 8 bytes
+ *   行数, 列数                    uint64_t
+ *   double [列数][行数]           列ごとに続けて置く
+ */
+
+static int isfs(int c) /* field separator */
+{
+  return c == ' ' || c == '\t' || c == ',' || c == '\r';
+}
+
+static void data_release(HocVM *vm)
+{
+  if (vm->dbase) {
+    if (vm->dmaplen) {
+      munmap(vm->dbase, vm->dmaplen);
+    } else {
+      free(vm->dbase);
+    }
+  }
+  vm->dbase = vm->dcur = vm->dend = 0;
+  vm->dmaplen = 0;
+  vm->nf = 0;
+  vm->cols = 0;
+  vm->nrows = vm->ncols = 0;
+}
+
+static int columnar(HocVM *vm, char *p, size_t len) /* p holds columnar data: use it */
+{
+  uint64_t nrows, ncols;
+
+  if (len < COLHDR || memcmp(p, COLMAGIC, 8) != 0) {
+    return 0;
+  }
+  memcpy(&nrows, p + 8, 8);
+  memcpy(&ncols, p + 16, 8);
+  if (ncols != 0 && nrows > (len - COLHDR) / sizeof(double) / ncols) {
+    return 0; /* 短すぎる ふつうのテキストとして読む */
+  }
+  vm->cols = (double *)(p + COLHDR);
+  vm->nrows = nrows;
+  vm->ncols = ncols;
+  vm->row = -1;
+  return 1;
+}
+
+static int data_slurp(HocVM *vm, int fd) /* read whole fd into a buffer ending in '\n' */
+{
+  size_t len = 0, size = 65536;
+  char *buf = malloc(size);
+  ssize_t n;
+
+  while (buf) {
+    if (len + 1 >= size) {
+      char *nbuf = realloc(buf, size *= 2);
+      if (nbuf == 0) {
+        break;
+      }
+      buf = nbuf;
+    }
+    n = read(fd, buf + len, size - len - 1);
+    if (n <= 0) {
+      if (columnar(vm, buf, len)) {
+        vm->dbase = buf;
+        return n < 0 ? -1 : 0;
+      }
+      if (len > 0 && buf[len-1] != '\n') {
+        buf[len++] = '\n';
+      }
+      vm->dbase = vm->dcur = buf;
+      vm->dend = buf + len;
+      return n < 0 ? -1 : 0;
+    }
+    len += n;
+  }
+  free(buf);
+  return -1;
+}
+
+int vm_data(HocVM *vm, const char *file) /* use file ("-": stdin) as the data stream */
+{
+  struct stat st;
+  char *p;
+  int fd, r;
+
+  data_release(vm);
+  if (strcmp(file, "-") == 0) {
+    return data_slurp(vm, 0);
+  }
+  if ((fd = open(file, O_RDONLY)) < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return 0;
+  }
+  p = S_ISREG(st.st_mode) ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  if (p != MAP_FAILED && columnar(vm, p, st.st_size)) {
+    vm->dbase = p;
+    vm->dmaplen = st.st_size;
+    close(fd);
+    return 0;
+  }
+  if (p != MAP_FAILED && p[st.st_size-1] == '\n') {
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    vm->dbase = vm->dcur = p;
+    vm->dend = p + st.st_size;
+    vm->dmaplen = st.st_size;
+    close(fd);
+    return 0;
+  }
+  if (p != MAP_FAILED) { /* 改行で終わらないファイルはコピーする */
+    munmap(p, st.st_size);
+  }
+  r = data_slurp(vm, fd);
+  close(fd);
+  return r;
+}
+
+void vm_data_free(HocVM *vm)
+{
+  data_release(vm);
+}
+
+static int nextrecord(HocVM *vm) /* split next line into fields */
+{
+  char *p = vm->dcur, *eol;
+
+  if (vm->cols) {
+    if (vm->row + 1 >= vm->nrows) {
+      return 0;
+    }
+    vm->row++;
+    vm->nf = vm->ncols;
+    return 1;
+  }
+  if (p == 0 || p >= vm->dend) {
+    return 0;
+  }
+  eol = memchr(p, '\n', vm->dend - p);
+  vm->dcur = eol + 1;
+  vm->nf = 0;
+  for (;;) {
+    while (p < eol && isfs(*p)) {
+      p++;
+    }
+    if (p >= eol) {
+      break;
+    }
+    if (vm->nf < NFIELD) {
+      vm->fld[vm->nf++] = p;
+    }
+    while (p < eol && !isfs(*p)) {
+      p++;
+    }
+  }
+  return 1;
+}
+
+void fieldpush(void) /* push value of field $n */
+{
+  HocVM *vm = curvm;
+  long n = (long)*vm->pc++;
+  Datum d;
+
+  d = mkint(0); /* 無いフィールドや数値でないフィールドは0 */
+  if (vm->cols && n >= 1 && n <= vm->nf) {
+    d = mkvalue(vm->cols[(n-1) * vm->nrows + vm->row]);
+  } else if (n >= 1 && n <= vm->nf) {
+    d = mkvalue(strtod(vm->fld[n-1], (char **) 0));
+  }
+  push(d);
+}
+
+void varread(void) /* read into variable */
+{
+  HocVM *vm = curvm;
+  Symbol *var = (Symbol *)*vm->pc++;
+  char *p = vm->dcur, *e;
+  double x;
+  Datum d;
+
+  if (var->type != VAR && var->type != UNDEF) {
+    execerror("attempt to read non-variable ", var->name);
+  }
+  if (vm->cols) {
+    execerror("read() from columnar data into ", var->name);
+  }
+  if (vm->dbase == 0) { /* データが無ければプログラムの入力から読む */
+    switch (fscanf(vm->fin, "%lf", &x)) {
+      case EOF:
+        d = mkbool(0);
+        break;
+      case 0:
+        execerror("non-number read into ", var->name);
+        break;
+      default:
+        var->type = VAR;
+        var->u.v = mkvalue(x);
+        changed(var);
+        d = mkbool(1);
+        break;
+    }
+    push(d);
+    return;
+  }
+  while (p < vm->dend && (isfs(*p) || *p == '\n')) {
+    p++;
+  }
+  if (p >= vm->dend) {
+    vm->dcur = p;
+    push(mkbool(0));
+    return;
+  }
+  x = strtod(p, &e);
+  if (e == p) {
+    execerror("non-number read into ", var->name);
+  }
+  var->type = VAR;
+  var->u.v = mkvalue(x);
+  changed(var);
+  vm->dcur = e;
+  push(mkbool(1));
+}
+
+long vm_block(HocVM *vm, double **col, double **buf, int nf, long max)
+{
+  /* 次のmax個までのレコードを読み、フィールドk+1の列をcol[k]にする (buf[k]が0なら使わない) */
+  long n;
+  int k;
+
+  if (vm->cols) { /* 列形式ならデータをそのまま使う */
+    n = vm->nrows - (vm->row + 1);
+    n = n < max ? n : max;
+    for (k = 0; k < nf; k++) {
+      if (buf[k] && k < vm->ncols) {
+        col[k] = vm->cols + k * vm->nrows + vm->row + 1;
+      } else if (buf[k]) {
+        memset(buf[k], 0, n * sizeof(double));
+        col[k] = buf[k];
+      }
+    }
+    vm->row += n;
+    return n;
+  }
+  for (n = 0; n < max && nextrecord(vm); n++) {
+    for (k = 0; k < nf; k++) {
+      if (buf[k]) {
+        buf[k][n] = k < vm->nf ? strtod(vm->fld[k], (char **) 0) : 0;
+      }
+    }
+  }
+  for (k = 0; k < nf; k++) {
+    col[k] = buf[k];
+  }
+  return n;
+}
+
+long vm_records(HocVM *vm, long max) /* run the program on up to max records, return how many */
+{
+  volatile long n = 0;
+  Inst *p;
+
+  if (setjmp(vm->begin)) {
+    vm->nerrors++; /* エラーになったレコードは飛ばす */
+    n++;
+  }
+  for (; n < max && nextrecord(vm); n++) {
+    initstack();
+    for (p = vm->prog; p < vm->progp; p = vm->pc + 1) {
+      execute(p);
+    }
+  }
+  return n;
+}
+
+int vm_run_records(HocVM *vm) /* run the compiled program once per data record */
+{
+  HocVM *saved = curvm;
+
+  curvm = vm;
+  if (vm->vec) {
+    vec_run(vm);
+  } else {
+    vm_records(vm, LONG_MAX);
+  }
+  curvm = saved;
+  return vm->nerrors;
+}
@@ -0,0 +1,163 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <stdlib.h>
+
+/*
+ * 導出変数 y := expr
+ *
+ * yは値ではなく式のコードを持ち、読まれたときに必要なら計算して値を覚えておく。
+ * 計算中に読んだ変数 (導出変数も含む) を記録し、それぞれの変数のusersに
+ * yをつないでおく。変数が書き換えられるとusersをたどって無効にするだけで
+ * (changed)、再計算は次に読まれたときまで延ばす。
+ * 依存関係は計算のたびに取り直すので、関数の中で読んだ変数や
+ * 条件によって読む変数が変わる式でも正しく追える。
+ */
+
+static Dep *newdep(Symbol *user)
+{
+  HocVM *vm = curvm;
+  Dep *d = vm->depfree;
+
+  if (d) {
+    vm->depfree = d->next;
+  } else {
+    d = (Dep *)arena_alloc(&vm->symarena, sizeof(Dep));
+  }
+  d->sym = user;
+  return d;
+}
+
+static void undepend(Symbol *sp) /* remove sp from the users of everything it read */
+{
+  Derived *dv = sp->u.dv;
+  Dep **dp, *d;
+  int i;
+
+  for (i = 0; i < dv->ndeps; i++) {
+    for (dp = &dv->deps[i]->users; (d = *dp) != 0; dp = &d->next) {
+      if (d->sym == sp) {
+        *dp = d->next;
+        d->next = curvm->depfree;
+        curvm->depfree = d;
+        break;
+      }
+    }
+  }
+  dv->ndeps = 0;
+}
+
+void invalidate(Symbol *sp) /* sp has changed: mark everything computed from it */
+{
+  Dep *d;
+
+  for (d = sp->users; d; d = d->next) {
+    Symbol *y = d->sym;
+    if (y->type == DERIVED && y->u.dv->valid) {
+      y->u.dv->valid = 0;
+      if (y->users) {
+        invalidate(y);
+      }
+    }
+  }
+}
+
+void depend(Symbol *sp) /* the derived variable being computed reads sp */
+{
+  Symbol *y = curvm->reading;
+  Derived *dv = y->u.dv;
+  Dep *d;
+  int i;
+
+  for (i = 0; i < dv->ndeps; i++) {
+    if (dv->deps[i] == sp) {
+      return;
+    }
+  }
+  if (dv->ndeps >= dv->maxdeps) {
+    dv->maxdeps = dv->maxdeps ? 2 * dv->maxdeps : 8;
+    dv->deps = (Symbol **)realloc(dv->deps, dv->maxdeps * sizeof(Symbol *));
+    if (dv->deps == 0) {
+      execerror("out of memory", (char *) 0);
+    }
+  }
+  dv->deps[dv->ndeps++] = sp;
+  d = newdep(y);
+  d->next = sp->users;
+  sp->users = d;
+}
+
+Datum derivedval(Symbol *sp) /* value of a derived variable, computed if needed */
+{
+  HocVM *vm = curvm;
+  Derived *dv = sp->u.dv;
+  Inst *savepc = vm->pc;
+  Symbol *y;
+
+  if (vm->inparallel) { /* 覚えた値も使わない 本体で依存する変数を書いても無効にならない */
+    execerror("derived variable in parallel for: ", sp->name);
+  }
+  if (dv->valid) {
+    return dv->val;
+  }
+  for (y = vm->reading; y; y = y->u.dv->outer) { /* 計算中の変数の連なり */
+    if (y == sp) {
+      execerror(sp->name, " is defined in terms of itself");
+    }
+  }
+  undepend(sp);
+  dv->outer = vm->reading;
+  vm->reading = sp;
+  execute(dv->code);
+  vm->reading = dv->outer;
+  vm->pc = savepc;
+  dv->val = pop();
+  dv->valid = 1;
+  return dv->val;
+}
+
+Inst *derivestart(Symbol *sp) /* begin y := expr, return start of the code */
+{
+  if (sp->type != UNDEF && sp->type != DERIVED) {
+    execerror(sp->name, " is already a variable");
+  }
+  curvm->persist = 1;
+  return curvm->progp;
+}
+
+void derive(Symbol *sp, Inst *start) /* move the expression [start, progp) out of prog */
+{
+  HocVM *vm = curvm;
+  Derived *dv;
+  int n;
+
+  optimize(start); /* 最適化で作る定数や隠れ変数もpersistのうちにsymarenaに置く */
+  vm->persist = 0;
+  vm->ndefs++;
+  n = vm->progp - start;
+  if (sp->type == DERIVED) { /* 定義し直し */
+    dv = sp->u.dv;
+  } else {
+    dv = (Derived *)arena_alloc(&vm->symarena, sizeof(Derived));
+    dv->deps = 0;
+    dv->ndeps = dv->maxdeps = 0;
+    sp->u.dv = dv;
+    sp->type = DERIVED;
+  }
+  dv->code = (Inst *)arena_alloc(&vm->symarena, n * sizeof(Inst));
+  codecopy(dv->code, start, vm->progp, 0, 0);
+  dv->valid = 0;
+  dv->outer = 0;
+  invalidate(sp); /* yを使っている導出変数も計算し直す */
+  vm->progp = start;
+}
+
+void derived_free(HocVM *vm)
+{
+  Symbol *sp;
+
+  for (sp = vm->symlist; sp; sp = sp->next) {
+    if (sp->type == DERIVED) {
+      free(sp->u.dv->deps);
+    }
+  }
+}
@@ -1,39 +1,385 @@
+#include <stdio.h>
+#include <setjmp.h>
+#include <math.h>
+#include <stdint.h>
+
+/*
+ * 値の表現 (NaN boxing)
+ * 64ビットの上位16ビットが 0xFFF9〜0xFFFB のものはタグ付きの値、それ以外はdouble
+ *   0xFFF9 : 48ビット符号付き整数
+ *   0xFFFA : 真偽値 (0か1)
+ *   0xFFFB : シンボルへのポインタ
+ * 演算で生じるNaNはこの範囲に入らない。外から読み込んだdoubleはmknumで正規化する
+ */
+typedef union Datum { /* interpreter stack type */
+  double val;
+  uint64_t bits;
+} Datum;
+
+#define TAG_INT  0xFFF9ULL
+#define TAG_BOOL 0xFFFAULL
+#define TAG_PTR  0xFFFBULL
+#define PAYLOAD  0x0000FFFFFFFFFFFFULL
+#define INTMAX48 ((int64_t)0x00007FFFFFFFFFFFLL)
+#define INTMIN48 (-INTMAX48 - 1)
+
+#define TAG(d)    ((d).bits >> 48)
+#define ISDBL(d)  ((d).bits < (TAG_INT << 48))
+#define ISINT(d)  (TAG(d) == TAG_INT)
+#define ISBOOL(d) (TAG(d) == TAG_BOOL)
+#define ISPTR(d)  (TAG(d) == TAG_PTR)
+#define INTVAL(d) ((int64_t)((d).bits << 16) >> 16)
+#define FITS48(i) ((i) >= INTMIN48 && (i) <= INTMAX48)
+
+static inline Datum mkint(int64_t i) /* i must fit in 48 bits */
+{
+  Datum d;
+  d.bits = (TAG_INT << 48) | ((uint64_t)i & PAYLOAD);
+  return d;
+}
+
+static inline Datum mkbool(int b)
+{
+  Datum d;
+  d.bits = (TAG_BOOL << 48) | (b != 0);
+  return d;
+}
+
+static inline Datum mknum(double x) /* box a double */
+{
+  Datum d;
+  d.val = x;
+  if (d.bits >= (TAG_INT << 48)) {
+    d.bits = 0x7FF8000000000000ULL; /* タグと重なるNaNは普通のNaNにする */
+  }
+  return d;
+}
+
+static inline Datum mkinteger(int64_t i) /* int if it fits, otherwise double */
+{
+  return FITS48(i) ? mkint(i) : mknum((double)i);
+}
+
+static inline Datum mkvalue(double x) /* int if x is a small whole number */
+{
+  if (x >= INTMIN48 && x <= INTMAX48 && x == (double)(int64_t)x && (x != 0.0 || !signbit(x))) {
+    return mkint((int64_t)x);
+  }
+  return mknum(x);
+}
+
+static inline double num(Datum d) /* numeric value as double */
+{
+  if (ISDBL(d)) {
+    return d.val;
+  }
+  if (ISINT(d)) {
+    return (double)INTVAL(d);
+  }
+  return (double)(d.bits & 1); /* bool */
+}
+
+static inline int istrue(Datum d)
+{
+  return ISDBL(d) ? d.val != 0.0 : (d.bits & PAYLOAD) != 0;
+}
+
+static inline Datum mksym(void *sp) /* sp is a Symbol * */
+{
+  Datum d;
+  d.bits = (TAG_PTR << 48) | ((uint64_t)(uintptr_t)sp & PAYLOAD);
+  return d;
+}
+
+#define SYM(d) ((Symbol *)(uintptr_t)((d).bits & PAYLOAD))
+
 typedef struct Symbol { /* Symbol table entry */
   char *name;
   short type; /* VAR, BLTIN, UNDEF */
   union {
-    double val;      /* if VAR */
+    Datum v;         /* if VAR */
     double (*ptr)(); /* if BLTIN */
+    struct Func *fn; /* if FUNCTION, PROCEDURE */
+    struct Derived *dv; /* if DERIVED */
+    struct Array *arr;  /* if ARRAY */
   } u;
+  struct Dep *users;   /* derived variables computed from this one */
   struct Symbol *next; /* to link to another */
 } Symbol;
 
 extern Symbol *install(char *s, int t, double d);
 extern Symbol *lookup(char *s);
+extern Symbol *constsym(double d);
+extern void *ctalloc(size_t n);
+
+typedef struct Arena { /* region allocator, see arena.c */
+  struct Block *head, *cur;
+  char *next, *limit;  /* free space in cur */
+  size_t blocksize;
+  size_t nalloc, nblock, nreset; /* statistics */
+  size_t used, peak, reserved;
+} Arena;
+
+extern void arena_init(Arena *a, size_t blocksize);
+extern void *arena_alloc(Arena *a, size_t n);
+extern void arena_reset(Arena *a);
+extern void arena_free(Arena *a);
+extern void arena_stats(Arena *a, const char *name, FILE *fp);
 
-typedef union Datum { /* interpreter stack type */
-  double val;
-  Symbol *sym;
-} Datum;
 extern Datum pop();
+extern Datum addv(Datum, Datum), subv(Datum, Datum), mulv(Datum, Datum), divv(Datum, Datum);
+extern Datum negv(Datum), powv(Datum, Datum), bltinv(double (*f)(), Datum);
+
+/* 比較 両方が整数なら整数で比べる 結果は真偽値 */
+#define COMPARE(a, op, b) \
+  (ISINT(a) && ISINT(b) ? INTVAL(a) op INTVAL(b) : num(a) op num(b))
+
+/*
+ * 2項演算子の表 (名前, a と b から結果を作る式, 左右を入れ替えたときの定数命令)
+ * code.cで命令 name と、右の値を定数で持つ name_k をここから作る
+ */
+#define BINOPS(X) \
+  X(add,    addv(a, b),                add_k) \
+  X(sub,    subv(a, b),                0) \
+  X(mul,    mulv(a, b),                mul_k) \
+  X(divide, divv(a, b),                0) \
+  X(gt,     mkbool(COMPARE(a, >, b)),  lt_k) \
+  X(lt,     mkbool(COMPARE(a, <, b)),  gt_k) \
+  X(ge,     mkbool(COMPARE(a, >=, b)), le_k) \
+  X(le,     mkbool(COMPARE(a, <=, b)), ge_k) \
+  X(eq,     mkbool(COMPARE(a, ==, b)), eq_k) \
+  X(ne,     mkbool(COMPARE(a, !=, b)), ne_k)
+extern double integer(double);
 
 typedef void (*Inst)(); /* machine instruction (voidを返す関数へのポインタ) */
 #define STOP (Inst) 0 /* 0をInst型にキャスト NULLポインタとして利用 */
 
-extern Inst prog[];
-extern Inst *progp;
+/* parallel for のリダクション宣言 */
+typedef struct Reduce {
+  int op;              /* '+', '*', 'm'(min), 'M'(max) */
+  Symbol *sym;         /* shared variable */
+  struct Reduce *next;
+} Reduce;
+
+#define NINLINE 32   /* これ以下の長さの関数は呼び出し側に展開する */
+#define NINLINEARG 8
+
+typedef struct Dep { /* Symbol.users list */
+  Symbol *sym;         /* derived variable that read the symbol */
+  struct Dep *next;
+} Dep;
+
+typedef struct Derived { /* y := expr */
+  Inst *code;          /* expression, ends with STOP */
+  Datum val;           /* cached value */
+  int valid;
+  Symbol **deps;       /* variables read by the last computation */
+  int ndeps, maxdeps;
+  Symbol *outer;       /* derived variable whose computation needs this one */
+} Derived;
+
+typedef struct Func { /* user-defined function or procedure */
+  Inst *code;          /* body, outside prog[] */
+  int len;             /* 本体の長さ */
+  int ninline;         /* 展開できる式の長さ 展開できなければ0 */
+  int nargs;           /* largest $n used by the inline expression */
+  Symbol *tmp[NINLINEARG]; /* 展開したときに引数を入れる隠れ変数 */
+} Func;
+
+typedef struct Array { /* load() or mapfile(): a[0] ... a[n-1] */
+  double *v;
+  long n;
+  struct Mapping *map; /* vがmmapしたファイルの中なら0でない 0ならmallocしたもの */
+} Array;
+
+typedef struct Frame { /* proc/func call stack */
+  Symbol *sp;          /* symbol table entry */
+  Inst *retpc;         /* where to resume after return */
+  Datum *args;         /* first argument on stack */
+  int nargs;           /* number of arguments */
+  int depth;           /* executeの入れ子の深さ */
+} Frame;
+
+typedef struct Ctl { /* vm_resumeで実行中の文の部分 (executeの再帰の代わり) */
+  int kind;            /* whileの条件, 本体 など */
+  Inst *at;            /* その命令のオペランド */
+} Ctl;
+
+#define NSTACK 256
+#define NFRAME 100
+#define NPROG 2000
+#define NFIELD 256 /* max fields per data record */
+#define NRAND 256  /* uniform random numbers made at a time */
+#define NLIT 16    /* numeric literals per cached statement */
+#define NCTL 256   /* nesting of statements run by vm_resume */
+
+/* 列形式のデータ (data.c, array.c) */
+#define COLMAGIC "HOCCOL1\n"
+#define COLHDR 24
+
+/*
+ * インタプリタ1つ分の状態
+ * スタック・プログラム・変数表・エラー復帰先・入出力をすべてここにまとめる
+ * 組み込み関数・定数・キーワードの表は全VMで共有する（読み取り専用）
+ */
+typedef struct HocVM {
+  Datum stack[NSTACK]; /* the stack */
+  Datum *stackp;       /* next free spot on stack */
+  Inst prog[NPROG];    /* the machine */
+  Inst *progp;         /* next free spot for code generation */
+  Inst *pc;            /* program counter during execution */
+  Frame frame[NFRAME]; /* call stack, frame[0] is the top level */
+  Frame *fp;           /* current frame */
+  int depth;           /* executeの入れ子の深さ */
+  int returning;       /* retdepthまで戻ってretpcから続ける */
+  int retdepth;
+  Inst *retpc;
+  int indef;           /* 関数定義の翻訳中 */
+  int persist;         /* := の式の翻訳中 */
+  Arena *keep;         /* 0でなければ文の定数などをstmtarenaでなくここに置く (キャッシュするコード) */
+  long ndefs;          /* 関数や導出変数を定義した回数 翻訳済みのコードが古くなる */
+  Symbol *symlist;     /* variables of this VM */
+  Arena symarena;      /* 変数とその名前 VMと同じ寿命 */
+  Arena stmtarena;     /* 数値定数など翻訳中の一時データ initcodeで捨てる */
+  int lineno;
+  int nerrors;
+  int trace;           /* マシンのデバック表示をするか */
+  jmp_buf begin;       /* execerrorの戻り先 */
+  FILE *fin;           /* program source */
+  FILE *fout;          /* print output */
+  FILE *ferr;          /* warnings */
+  const char *name;    /* エラーメッセージに表示する名前 */
+  int inparallel;      /* parallel for のワーカーとして実行中 */
+  int nofiles;         /* save, restore, load, mapfile を使わせない (hocd) */
+  char *dbase, *dcur, *dend; /* data stream for read() and $n */
+  size_t dmaplen;      /* mmapした長さ 0ならmalloc */
+  char *fld[NFIELD];   /* fields of the current record (pointers into data) */
+  int nf;
+  double *cols;        /* 列形式のデータ cols[フィールド * nrows + 行] */
+  long nrows, ncols, row;
+  struct Vec *vec;     /* 列ごとに実行する形に直したプログラム (-V) */
+  int regvm;           /* 文をレジスタマシンのコードに直して実行する (-R) */
+  struct RegCode *rcode; /* その翻訳用の領域 必要になったら作る */
+  char *image;         /* restoreした変数の画像 (mmap) */
+  size_t imagelen;
+  uint64_t rs[4];      /* 乱数の状態 (xoshiro256++) */
+  double rbuf[NRAND];  /* まとめて作った一様乱数 */
+  int rnext;           /* next unused rbuf[] */
+  int hasnormal;       /* normal()の2つ目の値が残っている */
+  double normal;
+  Symbol *reading;     /* 計算中の導出変数 読んだ変数を依存関係に加える */
+  Dep *depfree;        /* unused Dep nodes */
+  long steps;          /* あとこれだけ命令を実行したら予算を調べる (vm_tick) */
+  long window;         /* stepsに与えた命令数 */
+  long done;           /* 前の窓までに実行した命令数 (vm_insts) */
+  long ileft;          /* 残りの命令数の予算 -1なら無制限 */
+  double deadline;     /* 実行の期限 (vm_clockの秒) 0なら無制限 */
+  struct StmtCache *scache; /* 翻訳済みの文 (vm_run) 必要になったら作る */
+  Symbol *lit[NLIT];   /* 翻訳中の文に出てきた数値定数 */
+  int nlit;
+  Ctl ctl[NCTL];       /* vm_resume: 実行中のwhileやifの部分 */
+  int nctl;
+  long slice;          /* vm_resume: 戻るまでに実行できる残りの命令数 */
+  int paused;          /* vm_resume: 文の途中で戻った */
+  int timing;          /* 実行中のtime文の数 */
+  Datum *stackhigh;    /* time: 入れ子の内側で見たスタックの最高位置 */
+} HocVM;
+
+/* 実行中のVM スレッドごとに独立 */
+extern _Thread_local HocVM *curvm;
+
+extern HocVM *vm_create(void);
+extern void vm_free(HocVM *vm);
+extern void vm_load(HocVM *vm, FILE *fp);
+extern int vm_load_string(HocVM *vm, const char *src);
+extern int vm_run(HocVM *vm);
+extern int vm_compile(HocVM *vm);
+extern int vm_resume(HocVM *vm, long quota);
+extern int resume(HocVM *vm);
+extern int hocsched(char **files, int nfiles, long quota, int stats);
+extern int hocbatch(char **files, int nfiles, int nthreads, int regvm, int stats);
+extern int vm_data(HocVM *vm, const char *file);
+extern void vm_data_free(HocVM *vm);
+extern int vm_run_records(HocVM *vm);
+extern long vm_records(HocVM *vm, long max);
+extern long vm_block(HocVM *vm, double **col, double **buf, int nf, long max);
+extern struct Vec *vec_compile(HocVM *vm);
+extern void vec_run(HocVM *vm), vec_free(HocVM *vm), vec_stats(HocVM *vm, FILE *fp);
+extern int reg_run(HocVM *vm, Inst *p);
+extern void reg_free(HocVM *vm), reg_stats(HocVM *vm, FILE *fp);
+extern void vm_stats(HocVM *vm, FILE *fp);
+extern int vm_parse(HocVM *vm);
+extern int vm_slice(HocVM *vm, Inst **p, Inst *end, long quota);
+extern void vm_budget(HocVM *vm, long insts, double deadline);
+extern void vm_tick(HocVM *vm);
+extern double vm_clock(void);
+extern long vm_insts(HocVM *vm);
+extern void vm_charge(HocVM *vm, long n);
+extern int hocd(const char *path, long insts, double secs);
+extern uint64_t strhash(const char *s, size_t n);
+extern void stmt_open(HocVM *vm), stmt_close(HocVM *vm), stmt_free(HocVM *vm);
+extern Inst *stmt_lookup(HocVM *vm);
+extern void stmt_remember(HocVM *vm);
+extern void stmt_stats(HocVM *vm, FILE *fp);
+extern uint64_t vm_random(HocVM *vm);
+extern void vm_srand(HocVM *vm, uint64_t seed);
+extern void vm_randfill(HocVM *vm, double *buf, size_t n);
+extern int image_save(HocVM *vm, const char *file);
+extern int image_restore(HocVM *vm, const char *file);
+extern int image_lookup(HocVM *vm, const char *name, double *val);
+extern void image_free(HocVM *vm);
+extern int yyparse(void);
+
 extern Inst *code(Inst f); /* 関数ポインタを引き数に取り、関数ポインタへのポインタを返す */
-extern void eval(void), add(void), sub(void), mul(void), divide(void), negate(void), power(void);
+#define BINOP_DECL(name, expr, swapped) extern void name(void), name##_k(void);
+BINOPS(BINOP_DECL)
+extern void eval(void), negate(void), power(void);
 extern void assign(void), bltin(void), varpush(void), constpush(void), print(void), popstack(void);
 extern void prexpr();
-extern void gt(void), lt(void), eq(void), ge(void), le(void), ne(void), and(void), or(void), not(void);
+extern void not(void);
+extern void andcode(void), orcode(void), truth(void);
 extern void addeq(void), subeq(void), muleq(void), diveq(void);
 extern void pre_increment(void), post_increment(void), pre_decrement(void), post_decrement(void);
-extern void ifcode(void), whilecode(void);
+extern void timecode(void);
+extern void ifcode(void), whilecode(void), parforcode(void), forcode(void), forloop(void);
+extern void forfuse(Inst *f);
+extern int fortest(Symbol *i, Symbol *lim, int cmp);
+extern void fornext(Symbol *i, Symbol *inc, int down);
+extern void fieldpush(void), varread(void);
+extern void loadcode(void), mapcode(void), arrpush(void), arrstore(void);
+extern Symbol **namelist(Symbol **list, Symbol *sp);
+extern void array_free(HocVM *vm);
+extern void savecode(void), restorecode(void);
+extern void call(void), tailcall(void), arg(void), argassign(void), funcret(void), procret(void);
+extern void argstore(void), tmpval(void);
+extern void invreset(void), invar(void), invstore(void), duptop(void);
+extern void optimize(Inst *start);
+extern Datum derivedval(Symbol *sp);
+extern void depend(Symbol *sp), invalidate(Symbol *sp);
+extern Inst *derivestart(Symbol *sp);
+extern void derive(Symbol *sp, Inst *start);
+extern void derived_free(HocVM *vm);
+
+static inline void changed(Symbol *sp) /* call after storing into a variable */
+{
+  if (sp->users) {
+    invalidate(sp);
+  }
+}
+extern void define(Symbol *sp, Inst *start);
+extern Inst *callcode(Symbol *sp, int nargs);
+extern void binopcode(Inst *left, Inst *right, Inst op);
+extern void initstack(void);
+
+extern const char *inst_operands(Inst f);
+extern int inst_len(Inst *p);
+extern void codecopy(Inst *dst, Inst *from, Inst *to, Symbol *(*map)(Symbol *, void *), void *arg);
 
 extern void execerror(const char *s, const char *t);
+extern void warning(const char *s, const char *t);
+extern void init(void);
+extern char *emalloc(unsigned n);
 
 extern void push(Datum d);
 extern void initcode(void);
 extern void execute(Inst *p);
-
@@ -4,27 +4,44 @@
 #include <signal.h>
 #include <setjmp.h>
 #include <stdlib.h>
+#include <string.h>
 #include "hoc.h"
 #define code2(c1,c2) code(c1); code(c2);
 #define code3(c1,c2,c3) code(c1); code(c2); code(c3);
 
-int yylex(void);
 void yyerror(const char *s);
-void warning(const char *s, const char *t);
-void execerror(const char *s, const char *t);
 void fpecatch(int sig);
-void init(void);
-void initcode(void);
-void execute(Inst *p);
 int follow(int expect, int ifyes, int ifno); 
+void defnonly(const char *s);
+Inst *defstart(Symbol *sp, int type);
+Reduce *newreduce(int op, Symbol *sym, Reduce *next);
 %}
+%define api.pure full
 
 %union{
   Symbol *sym;  /* symbol table pointer */
   Inst *inst; /* machine instruction */
+  Reduce *red; /* reduction list of parallel for */
+  int num;
+  char *str;
+  Symbol **syms; /* names of load() */
 }
-%token <sym> NUMBER PRINT VAR BLTIN UNDEF WHILE IF ELSE /* 終端記号 */
-%type <inst> stmt asgn expr stmtlist cond while if end /* 非終端記号 */
+%{
+int yylex(YYSTYPE *lvalp);
+%}
+%token <sym> NUMBER PRINT VAR BLTIN UNDEF WHILE IF ELSE PARALLEL FOR REDUCE READ SAVE RESTORE
+%token <sym> LOAD ARRAY TIME MAPFILE
+%token <sym> FUNCTION PROCEDURE FUNC PROC RETURN DERIVED DEFINE /* 終端記号 */
+%token <num> FIELD
+%token <str> STRING
+%type <str> mapmode
+%type <inst> stmt asgn expr stmtlist cond while if begin end parfor forexpr forcond time /* 非終端記号 */
+%type <red> reduce redlist
+%type <num> redop arglist
+%type <sym> procname
+%type <syms> loadnames
+%nonassoc RETURN /* return の後に式が続けば return expr にする */
+%nonassoc NUMBER VAR FIELD FUNCTION BLTIN READ LOAD '('
 %right '=' ADDEQ SUBEQ MULEQ DIVEQ INCREMENT DECREMENT
 %left OR
 %left AND
@@ -39,8 +56,13 @@ list:  /* nothing */
     | list '\n'
     | list asgn '\n' { code2(popstack, STOP); return 1; }
     | list stmt '\n' { code(STOP); return 1; }
+    | list defn '\n'
     | list expr '\n' { code2(print, STOP); return 1; }
-    | list error '\n' { yyerrok; }
+    | list error '\n' { /* 作りかけのコードは呼び出し側で捨てる */
+      yyerrok;
+      curvm->indef = curvm->persist = 0;
+      return 1;
+    }
     ;
 asgn: VAR '=' expr {
       $$ = $3;
@@ -63,20 +85,29 @@ asgn: VAR '=' expr {
       code3(varpush, (Inst)$1, diveq);
     }
     | INCREMENT VAR {
-      $$ = $2;
-      code3(varpush, (Inst)$2, pre_increment);
+      $$ = code3(varpush, (Inst)$2, pre_increment);
     }
     | VAR INCREMENT {
-      $$ = $1;
-      code3(varpush, (Inst)$1, post_increment);
+      $$ = code3(varpush, (Inst)$1, post_increment);
     }
     | DECREMENT VAR {
-      $$ = $2;
-      code3(varpush, (Inst)$2, pre_decrement);
+      $$ = code3(varpush, (Inst)$2, pre_decrement);
     }
     | VAR DECREMENT {
-      $$ = $1;
-      code3(varpush, (Inst)$1, post_decrement);
+      $$ = code3(varpush, (Inst)$1, post_decrement);
+    }
+    | VAR '[' expr ']' '=' expr {
+      $$ = $3;
+      code2(arrstore, (Inst)$1);
+    }
+    | VAR '=' MAPFILE '(' STRING mapmode ')' { /* ファイルをmmapした配列にする */
+      $$ = code(mapcode);
+      code3((Inst)$1, (Inst)$5, (Inst)$6);
+    }
+    | FIELD '=' expr { /* $n = expr in a function: assign to argument */
+      defnonly("$");
+      $$ = $3;
+      code2(argassign, (Inst)(long)$1);
     }
     ;
 stmt: expr { code(popstack); }
@@ -84,6 +115,28 @@ stmt: expr { code(popstack); }
       code(prexpr);
       $$ = $2;
     }
+    | RETURN {
+      defnonly("return");
+      $$ = code(procret);
+    }
+    | RETURN expr {
+      defnonly("return");
+      $$ = $2;
+      if (curvm->progp - $2 >= 3 && curvm->progp[-3] == call) {
+        curvm->progp[-3] = tailcall; /* return f(...) はフレームを使い回す */
+      }
+      code(funcret);
+    }
+    | PROCEDURE begin '(' arglist ')' {
+      $$ = $2;
+      callcode($1, $4);
+    }
+    | SAVE STRING { /* save variables to a file */
+      $$ = code2(savecode, (Inst)$2);
+    }
+    | RESTORE STRING {
+      $$ = code2(restorecode, (Inst)$2);
+    }
     | while cond stmt end {
       ($1)[1] = (Inst)$3; /* body of loop */
       ($1)[2] = (Inst)$4; /* end, if cond fails */
@@ -100,6 +153,87 @@ stmt: expr { code(popstack); }
     | '{' stmtlist '}' {
       $$ = $2;
     }
+    | time stmt end { /* 実行時間などをferrに出す */
+      ($1)[1] = (Inst)$2; /* body */
+      ($1)[2] = (Inst)$3; /* next statement */
+    }
+    | FOR '(' forexpr ';' { $<inst>$ = code(forcode); code3(STOP, STOP, STOP); }
+        forcond ';' { code(STOP); $<inst>$ = curvm->progp; }
+        forexpr ')' { code(STOP); } stmt end {
+      ($<inst>5)[1] = (Inst)$12; /* body */
+      ($<inst>5)[2] = (Inst)$13; /* next statement */
+      ($<inst>5)[3] = (Inst)$<inst>8; /* step */
+      $$ = $3;
+      forfuse($<inst>5); /* 数え上げのループならforloopにする */
+    }
+    | parfor '(' VAR '=' expr ';' { code(STOP); $<inst>$ = curvm->progp; }
+        VAR LT expr ';' VAR INCREMENT ')' { code(STOP); } reduce stmt end {
+      if ($3 != $8 || $3 != $12) {
+        execerror("parallel for: loop variable mismatch", (char *) 0);
+      }
+      ($1)[1] = (Inst)$3;  /* loop variable */
+      ($1)[2] = (Inst)$16; /* reductions */
+      ($1)[3] = (Inst)$<inst>7; /* upper bound */
+      ($1)[4] = (Inst)$17; /* body */
+      ($1)[5] = (Inst)$18; /* next statement */
+      $$ = $1;
+    }
+    ;
+forexpr: /* nothing */ { $$ = curvm->progp; }
+    | expr { code(popstack); }
+    ;
+forcond: /* nothing */ { $$ = code2(constpush, (Inst)constsym(1.0)); }
+    | expr
+    ;
+mapmode: /* nothing */ { $$ = 0; }
+    | ',' STRING { $$ = $2; }
+    ;
+loadnames: /* nothing */ { $$ = namelist(0, 0); }
+    | loadnames ',' VAR { $$ = namelist($1, $3); }
+    ;
+reduce: /* nothing */ { $$ = 0; }
+    | REDUCE '(' redlist ')' { $$ = $3; }
+    ;
+redlist: redop VAR { $$ = newreduce($1, $2, 0); }
+    | redlist ',' redop VAR { $$ = newreduce($3, $4, $1); }
+    ;
+redop: '+' { $$ = '+'; }
+    | '*' { $$ = '*'; }
+    | VAR { /* min, max */
+      if (strcmp($1->name, "min") == 0) {
+        $$ = 'm';
+      } else if (strcmp($1->name, "max") == 0) {
+        $$ = 'M';
+      } else {
+        yyerror("unknown reduction");
+        YYERROR;
+      }
+    }
+    ;
+defn: FUNC procname { $<inst>$ = defstart($2, FUNCTION); }
+        '(' ')' stmt {
+      code(procret);
+      define($2, $<inst>3);
+      curvm->indef = 0;
+    }
+    | PROC procname { $<inst>$ = defstart($2, PROCEDURE); }
+        '(' ')' stmt {
+      code(procret);
+      define($2, $<inst>3);
+      curvm->indef = 0;
+    }
+    | VAR DEFINE { $<inst>$ = derivestart($1); } expr { /* y := expr */
+      code(STOP);
+      derive($1, $<inst>3);
+    }
+    ;
+procname: VAR
+    | FUNCTION
+    | PROCEDURE
+    ;
+arglist: /* nothing */ { $$ = 0; }
+    | expr { $$ = 1; }
+    | arglist ',' expr { $$ = $1 + 1; }
     ;
 cond: '(' expr ')' {
       code(STOP);
@@ -110,17 +244,29 @@ while: WHILE {
       $$ = code3(whilecode, STOP, STOP);
     }
     ;
+parfor: PARALLEL FOR {
+      $$ = code(parforcode);
+      code3(STOP, STOP, STOP);
+      code2(STOP, STOP);
+    }
+    ;
+time: TIME {
+      $$ = code3(timecode, STOP, STOP);
+    }
+    ;
 if: IF {
       $$ = code(ifcode);
       code3(STOP, STOP, STOP);
     }
     ;
+begin: /* nothing */ { $$ = curvm->progp; }
+    ;
 end: /* nothing */ {
       code(STOP);
-      $$ = progp;
+      $$ = curvm->progp;
     }
     ;
-stmtlist: /* nothing */ { $$ = progp; }
+stmtlist: /* nothing */ { $$ = curvm->progp; }
     | stmtlist '\n'
     | stmtlist stmt
     ;
@@ -130,29 +276,56 @@ expr: NUMBER {
     | VAR { 
       $$ = code3(varpush, (Inst)$1, eval); 
     }
+    | FIELD { /* $n: argument in a function, otherwise field of the current data record */
+      $$ = code2(curvm->indef ? arg : fieldpush, (Inst)(long)$1);
+    }
+    | FUNCTION begin '(' arglist ')' {
+      $$ = $2;
+      callcode($1, $4);
+    }
+    | READ '(' VAR ')' {
+      $$ = code2(varread, (Inst)$3);
+    }
+    | LOAD '(' STRING loadnames ')' { /* 列を配列に読み込み、行数を返す */
+      $$ = code3(loadcode, (Inst)$3, (Inst)$4);
+    }
+    | VAR '[' expr ']' {
+      $$ = $3;
+      code2(arrpush, (Inst)$1);
+    }
     | asgn
     | BLTIN '(' expr ')' {
       $$ = $3;
       code2(bltin, (Inst)$1->u.ptr); 
     }
+    | BLTIN '(' ')' { /* clock() など 引数は0 */
+      $$ = code2(constpush, (Inst)constsym(0.0));
+      code2(bltin, (Inst)$1->u.ptr);
+    }
     | '(' expr ')' { $$ = $2; }
-    | expr '+' expr { code(add); }
-    | expr '-' expr { code(sub); }
-    | expr '*' expr { code(mul); }
-    | expr '/' expr { code(divide); }
+    | expr '+' expr { binopcode($1, $3, add); }
+    | expr '-' expr { binopcode($1, $3, sub); }
+    | expr '*' expr { binopcode($1, $3, mul); }
+    | expr '/' expr { binopcode($1, $3, divide); }
     | expr '^' expr { code(power); }
     | '-' expr %prec UNARYMINUS { 
       $$ = $2;
       code(negate); 
     }
-    | expr GT expr { code(gt); }
-    | expr GE expr { code(ge); }
-    | expr LT expr { code(lt); }
-    | expr LE expr { code(le); }
-    | expr EQ expr { code(eq); }
-    | expr NE expr { code(ne); }
-    | expr AND expr { code(and); }
-    | expr OR expr { code(or); }
+    | expr GT expr { binopcode($1, $3, gt); }
+    | expr GE expr { binopcode($1, $3, ge); }
+    | expr LT expr { binopcode($1, $3, lt); }
+    | expr LE expr { binopcode($1, $3, le); }
+    | expr EQ expr { binopcode($1, $3, eq); }
+    | expr NE expr { binopcode($1, $3, ne); }
+    | expr AND { $<inst>$ = code2(andcode, STOP); } expr {
+      code(truth);
+      ($<inst>3)[1] = (Inst)curvm->progp; /* 左が偽なら右を飛ばす */
+    }
+    | expr OR { $<inst>$ = code2(orcode, STOP); } expr {
+      code(truth);
+      ($<inst>3)[1] = (Inst)curvm->progp; /* 左が真なら右を飛ばす */
+    }
     | NOT expr {
       $$ = $2;
       code(not);
@@ -167,25 +340,110 @@ expr: NUMBER {
 /* end of grammar */
 
 char *progname;
-int lineno = 1;
-jmp_buf begin;
+
+static int usage(void)
+{
+  fprintf(stderr, "usage: %s [-s] [-r image] [-R] [-V] [-f prog [data...]]\n", progname);
+  fprintf(stderr, "       %s -d socket [-b insts] [-t secs]\n", progname);
+  fprintf(stderr, "       %s -m [-s] [-q quota] prog...\n", progname);
+  fprintf(stderr, "       %s -j n [-s] [-R] prog...\n", progname);
+  return 2;
+}
+
 int main(int argc, char *argv[])
 {
+  HocVM *vm;
+  FILE *fp;
+  char *progfile = 0, *image = 0, *sock = 0;
+  long insts = 100000000, quota = 10000;
+  double secs = 5;
+  int i, stats = 0, vector = 0, regvm = 0, sched = 0, jobs = 0;
+
   progname = argv[0];
-  init();
-  setjmp(begin);
+  for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+    if (strcmp(argv[i], "-s") == 0) { /* 終了時に統計を表示 */
+      stats = 1;
+    } else if (strcmp(argv[i], "-V") == 0) { /* -fのプログラムをレコードのまとまりごとに実行 */
+      vector = 1;
+    } else if (strcmp(argv[i], "-m") == 0) { /* 引数のプログラムを全部1つのスレッドで並行に */
+      sched = 1;
+    } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) { /* -mで1回に実行する命令数 */
+      quota = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) { /* 引数のプログラムをjobs個のスレッドで */
+      if ((jobs = atoi(argv[++i])) < 1) {
+        return usage();
+      }
+    } else if (strcmp(argv[i], "-R") == 0) { /* 文をレジスタマシンで実行 */
+      regvm = 1;
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      progfile = argv[++i];
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) { /* 保存した変数で始める */
+      image = argv[++i];
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) { /* デーモンになる */
+      sock = argv[++i];
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) { /* 1リクエストの命令数 */
+      insts = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) { /* 1リクエストの秒数 */
+      secs = atof(argv[++i]);
+    } else {
+      return usage();
+    }
+  }
+  if (sched && regvm) { /* 途中で止めて再開するのはスタックマシンだけ */
+    return usage();
+  }
   signal(SIGFPE, fpecatch);
-  for (initcode(); yyparse(); initcode()) {
-    execute(prog);
+  if (sock) {
+    return hocd(sock, insts, secs) < 0;
+  }
+  if (jobs) {
+    return hocbatch(argv + i, argc - i, jobs, regvm, stats) != 0;
+  }
+  if (sched) {
+    return hocsched(argv + i, argc - i, quota > 0 ? quota : 1, stats) != 0;
   }
-  return 0;
+  vm = vm_create();
+  vm->name = progname;
+  vm->regvm = regvm;
+  if (image && image_restore(vm, image) < 0) {
+    fprintf(stderr, "%s: can't restore %s\n", progname, image);
+    return 1;
+  }
+  if (progfile) {
+    /* hoc5 -f prog data... : プログラムを一度だけ翻訳し、データの各行に対して実行する */
+    if ((fp = fopen(progfile, "r")) == 0) {
+      fprintf(stderr, "%s: can't open %s\n", progname, progfile);
+      return 1;
+    }
+    vm_load(vm, fp);
+    if (vm_compile(vm) < 0) {
+      return 1;
+    }
+    if (vector) {
+      vm->vec = vec_compile(vm); /* 直せなければ1行ずつ */
+    }
+    do {
+      if (vm_data(vm, i < argc ? argv[i] : "-") < 0) {
+        fprintf(stderr, "%s: can't read %s\n", progname, i < argc ? argv[i] : "-");
+        return 1;
+      }
+      vm_run_records(vm);
+    } while (++i < argc);
+  } else {
+    vm_run(vm);
+  }
+  if (stats) {
+    vm_stats(vm, stderr);
+  }
+  return vm->nerrors != 0 && progfile;
 }
 
-int yylex(void)
+int yylex(YYSTYPE *lvalp)
 {
+  FILE *fin = curvm->fin;
   int c;
 
-  while ((c = getchar()) == ' ' || c == '\t') {
+  while ((c = getc(fin)) == ' ' || c == '\t') {
     /* 空白とタブをスキップ（何もしない） */
   }
   if (c == EOF) {
@@ -196,23 +454,51 @@ int yylex(void)
     char sbuf[100], *p = sbuf;
     do {
       *p++ = c;
-    } while ((c=getchar()) != EOF && isalnum(c));
-    ungetc(c, stdin);
+    } while ((c=getc(fin)) != EOF && isalnum(c));
+    ungetc(c, fin);
     *p = '\0';
     if ((s=lookup(sbuf)) == 0) {
       s = install(sbuf, UNDEF, 0.0);
     }
-    yylval.sym = s;
-    if (s->type == UNDEF) {
+    lvalp->sym = s;
+    if (s->type == UNDEF || s->type == DERIVED || s->type == ARRAY) {
       return VAR;
     }
     return s->type;
   }
+  if (c == '"') { /* string */
+    char sbuf[1024], *p = sbuf;
+    while ((c = getc(fin)) != '"') {
+      if (c == '\n' || c == EOF) {
+        execerror("missing quote", (char *) 0);
+      }
+      if (p >= sbuf + sizeof(sbuf) - 1) {
+        execerror("string too long", (char *) 0);
+      }
+      *p++ = c;
+    }
+    *p = '\0';
+    lvalp->str = strcpy(ctalloc(p - sbuf + 1), sbuf);
+    return STRING;
+  }
+  if (c == '$') { /* field or argument */
+    int n = 0;
+    while ((c = getc(fin)) != EOF && isdigit(c)) {
+      n = 10 * n + c - '0';
+    }
+    ungetc(c, fin);
+    lvalp->num = n;
+    return FIELD;
+  }
   if (c == '.' || isdigit(c)) { /* number */
     double d;
-    ungetc(c, stdin);
-    scanf("%lf", &d);
-    yylval.sym = install("", NUMBER, d);
+    ungetc(c, fin);
+    fscanf(fin, "%lf", &d);
+    lvalp->sym = constsym(d);
+    if (curvm->nlit < NLIT) { /* 文のキャッシュで値を差し替える */
+      curvm->lit[curvm->nlit] = lvalp->sym;
+    }
+    curvm->nlit++;
     return NUMBER;
   }
   switch (c) {
@@ -226,30 +512,29 @@ int yylex(void)
     case '-': return follow('=', SUBEQ, follow('-', DECREMENT, '-'));
     case '*': return follow('=', MULEQ, '*');
     case '/': return follow('=', DIVEQ, '/');
-    case '\n': lineno++; return '\n';
+    case ':': return follow('=', DEFINE, ':');
+    case '\n': curvm->lineno++; return '\n';
     default: return c;
   }
-  if (c == '\n') { /* return */
-    lineno++;
-    return '\n';
-  }
-  return c;
 }
 
 int follow(int expect, int ifyes, int ifno) /* look after for >=, etc... */
 {
-  int c = getchar();
+  int c = getc(curvm->fin);
   if (c == expect){
     return ifyes;
   }
-  ungetc(c, stdin);
+  ungetc(c, curvm->fin);
   return ifno;
 }
 
 void execerror(const char *s, const char *t)
 {
   warning(s,t);
-  longjmp(begin, 0);
+  if (curvm == 0) {
+    exit(1);
+  }
+  longjmp(curvm->begin, 0);
 }
 
 void fpecatch(int sig)
@@ -257,17 +542,41 @@ void fpecatch(int sig)
   execerror("floating point exception", (char *) 0);
 }
 
+void defnonly(const char *s) /* warn if illegal definition */
+{
+  if (!curvm->indef) {
+    execerror(s, " used outside definition");
+  }
+}
+
+Inst *defstart(Symbol *sp, int type) /* begin definition of sp, return start of body */
+{
+  if (sp->type == DERIVED) {
+    execerror(sp->name, " is a derived variable");
+  }
+  if (sp->type != FUNCTION && sp->type != PROCEDURE) {
+    sp->u.fn = 0; /* 変数だった名前: 本体ができるまでは未定義の関数 */
+  }
+  sp->type = type;
+  curvm->indef = 1;
+  return curvm->progp;
+}
+
 void yyerror(const char *s)
 {
+  curvm->nerrors++;
   warning(s, (char *) 0);
 }
 
 void warning(const char *s, const char *t)
 {
-  fprintf(stderr, "%s: %s", progname, s);
+  if (curvm == 0) {
+    fprintf(stderr, "%s: %s%s\n", progname, s, t ? t : "");
+    return;
+  }
+  fprintf(curvm->ferr, "%s: %s", curvm->name, s);
   if(t){
-    fprintf(stderr, "%s", t);
+    fprintf(curvm->ferr, "%s", t);
   }
-  fprintf(stderr, " near line %d\n", lineno);
+  fprintf(curvm->ferr, " near line %d\n", curvm->lineno);
 }
-
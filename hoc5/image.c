@@ -0,0 +1,274 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * 変数の保存と復元
+ *
+ * 画像ファイルは変数名をキーとするオープンアドレス法のハッシュ表そのもので、
+ * restoreはファイルをmmapするだけで終わる。変数は最初に参照されたときに
+ * 表から引いてVMの変数表に登録する。
+ *
+ *   Header
+ *   Slot slot[nslot]    nslotは2のべき乗 name==0なら空き
+ *   char strings[]      '\0'終端の変数名を並べたもの
+ */
+
+#define IMAGE_MAGIC "HOCV"
+#define IMAGE_VERSION 1
+
+typedef struct Header {
+  char magic[4];
+  uint32_t version;
+  uint32_t nslot;
+  uint32_t nvar;
+  uint64_t strsize;
+} Header;
+
+typedef struct Slot {
+  uint32_t name;  /* offset+1 into strings, 0 if empty */
+  uint32_t hash;
+  double val;
+} Slot;
+
+static uint32_t hash(const char *s) /* FNV-1a */
+{
+  uint32_t h = 2166136261u;
+  while (*s) {
+    h = (h ^ (unsigned char)*s++) * 16777619u;
+  }
+  return h;
+}
+
+static Slot *probe(Slot *slot, uint32_t nslot, const char *strings, const char *name, uint32_t h)
+{
+  uint32_t i;
+
+  for (i = h & (nslot - 1); slot[i].name; i = (i + 1) & (nslot - 1)) {
+    if (slot[i].hash == h && strcmp(strings + slot[i].name - 1, name) == 0) {
+      break;
+    }
+  }
+  return &slot[i];
+}
+
+int image_lookup(HocVM *vm, const char *name, double *val) /* find name in restored image */
+{
+  Header *h = (Header *)vm->image;
+  Slot *sp;
+
+  if (h == 0) {
+    return 0;
+  }
+  sp = probe((Slot *)(h + 1), h->nslot, (char *)((Slot *)(h + 1) + h->nslot), name, hash(name));
+  if (sp->name == 0) {
+    return 0;
+  }
+  *val = sp->val;
+  return 1;
+}
+
+void image_free(HocVM *vm)
+{
+  if (vm->image) {
+    munmap(vm->image, vm->imagelen);
+    vm->image = 0;
+    vm->imagelen = 0;
+  }
+}
+
+static int valid(Header *h, uint64_t size) /* check everything probe() and image_save() rely on */
+{
+  Slot *slot = (Slot *)(h + 1);
+  char *strings;
+  uint32_t i, n = 0;
+
+  if (memcmp(h->magic, IMAGE_MAGIC, 4) != 0 || h->version != IMAGE_VERSION
+      || h->nslot == 0 || (h->nslot & (h->nslot - 1)) != 0) {
+    return 0;
+  }
+  /* 足し算があふれないよう引き算で大きさを確かめる */
+  if ((uint64_t)h->nslot * sizeof(Slot) > size - sizeof(Header)
+      || h->strsize != size - sizeof(Header) - (uint64_t)h->nslot * sizeof(Slot)) {
+    return 0;
+  }
+  strings = (char *)(slot + h->nslot);
+  if (h->strsize > 0 && strings[h->strsize - 1] != '\0') {
+    return 0; /* どの名前も文字列の領域の中で終わる */
+  }
+  for (i = 0; i < h->nslot; i++) {
+    if (slot[i].name) {
+      if (slot[i].name - 1 >= h->strsize) {
+        return 0;
+      }
+      n++;
+    }
+  }
+  return n == h->nvar && n < h->nslot; /* 空きが無いと探索が止まらない */
+}
+
+int image_restore(HocVM *vm, const char *file)
+{
+  struct stat st;
+  Header *h;
+  Symbol *sp;
+  char *p;
+  int fd;
+
+  if ((fd = open(file, O_RDONLY)) < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(Header)) {
+    close(fd);
+    return -1;
+  }
+  p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return -1;
+  }
+  h = (Header *)p;
+  if (!valid(h, st.st_size)) {
+    munmap(p, st.st_size);
+    return -1;
+  }
+  image_free(vm);
+  vm->image = p;
+  vm->imagelen = st.st_size;
+  /* すでにある変数だけはその場で値を差し替える */
+  for (sp = vm->symlist; sp; sp = sp->next) {
+    double d;
+    if ((sp->type == VAR || sp->type == UNDEF) && image_lookup(vm, sp->name, &d)) {
+      sp->type = VAR;
+      sp->u.v = mkvalue(d);
+      changed(sp);
+    }
+  }
+  return 0;
+}
+
+static void put(Slot *slot, uint32_t nslot, char *strings, uint64_t *strsize, const char *name, double val)
+{
+  uint32_t h = hash(name);
+  Slot *sp = probe(slot, nslot, strings, name, h);
+
+  if (sp->name) {
+    return; /* 先に入れたものを優先 */
+  }
+  sp->name = *strsize + 1;
+  sp->hash = h;
+  sp->val = val;
+  strcpy(strings + *strsize, name);
+  *strsize += strlen(name) + 1;
+}
+
+int image_save(HocVM *vm, const char *file) /* write all variables to file */
+{
+  Header hdr, *old = (Header *)vm->image;
+  Slot *slot, *oslot = old ? (Slot *)(old + 1) : 0;
+  char *strings, *ostrings = old ? (char *)(oslot + old->nslot) : 0;
+  char *tmp;
+  uint64_t strmax = 0, strsize = 0;
+  uint32_t nvar = 0, nslot = 16, i;
+  Symbol *sp;
+  FILE *fp;
+  int ok;
+
+  for (sp = vm->symlist; sp; sp = sp->next) {
+    if (sp->type == VAR) {
+      nvar++;
+      strmax += strlen(sp->name) + 1;
+    }
+  }
+  if (old) { /* 参照されずに残っている変数も引き継ぐ */
+    nvar += old->nvar;
+    strmax += old->strsize;
+  }
+  while (nslot < 2 * nvar) { /* 負荷率は1/2以下 */
+    nslot *= 2;
+  }
+  slot = (Slot *)calloc(nslot, sizeof(Slot));
+  strings = malloc(strmax + 1);
+  tmp = malloc(strlen(file) + 8);
+  if (slot == 0 || strings == 0 || tmp == 0) {
+    free(slot);
+    free(strings);
+    free(tmp);
+    return -1;
+  }
+  for (sp = vm->symlist; sp; sp = sp->next) {
+    if (sp->type == VAR) {
+      put(slot, nslot, strings, &strsize, sp->name, num(sp->u.v));
+    }
+  }
+  for (i = 0; old && i < old->nslot; i++) {
+    if (oslot[i].name) {
+      put(slot, nslot, strings, &strsize, ostrings + oslot[i].name - 1, oslot[i].val);
+    }
+  }
+  nvar = 0;
+  for (i = 0; i < nslot; i++) {
+    nvar += slot[i].name != 0;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, IMAGE_MAGIC, 4);
+  hdr.version = IMAGE_VERSION;
+  hdr.nslot = nslot;
+  hdr.nvar = nvar;
+  hdr.strsize = strsize;
+
+  /* 書き込み途中のファイルを読まれないよう別名で書いてからrenameする */
+  sprintf(tmp, "%s.tmp", file);
+  ok = (fp = fopen(tmp, "wb")) != 0
+    && fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+    && fwrite(slot, sizeof(Slot), nslot, fp) == nslot
+    && fwrite(strings, 1, strsize, fp) == strsize;
+  if (fp && fclose(fp) != 0) {
+    ok = 0;
+  }
+  ok = ok && rename(tmp, file) == 0;
+  if (!ok) {
+    unlink(tmp);
+  }
+  free(slot);
+  free(strings);
+  free(tmp);
+  return ok ? 0 : -1;
+}
+
+void savecode(void) /* save "file" */
+{
+  char *file = (char *)*curvm->pc++;
+
+  if (curvm->inparallel) { /* ワーカーの記号表は空 */
+    execerror("save in parallel for", (char *) 0);
+  }
+  if (curvm->nofiles) {
+    execerror("file access not allowed: ", file);
+  }
+  if (image_save(curvm, file) < 0) {
+    execerror("can't save ", file);
+  }
+}
+
+void restorecode(void) /* restore "file" */
+{
+  char *file = (char *)*curvm->pc++;
+
+  if (curvm->inparallel) { /* ワーカーの記号表は空 */
+    execerror("restore in parallel for", (char *) 0);
+  }
+  if (curvm->nofiles) {
+    execerror("file access not allowed: ", file);
+  }
+  if (image_restore(curvm, file) < 0) {
+    execerror("can't restore ", file);
+  }
+}
@@ -3,6 +3,7 @@
 #include <math.h>
 
 extern double Log(), Log10(), Exp(), Sqrt(), integer(), Atan2(), Rand();
+extern double Srand(), Normal(), Exponential(), Clock(), Cycles();
 
 static struct { /* Constants */
   char *name;
@@ -21,7 +22,12 @@ static struct { /* Build-ins */
                 "log10", Log10, /* checks argument */
                 "exp",   Exp,   /* checks argument */
                 "sqer",  Sqrt,  /* checks argument */
-                "int",   integer, "abs", fabs, "rand", Rand, 0,      0};
+                "int",   integer, "abs", fabs, "rand", Rand,
+                "srand", Srand, /* per-VM generator, see rand.c */
+                "normal", Normal, "exponential", Exponential,
+                "clock", Clock,   /* ns, monotonic */
+                "cycles", Cycles, /* CPU cycle counter */
+                0, 0};
 
 static struct { /* Keywords */
   char *name;
@@ -31,6 +37,18 @@ static struct { /* Keywords */
   "else", ELSE,
   "while", WHILE,
   "print", PRINT,
+  "parallel", PARALLEL,
+  "for", FOR,
+  "reduce", REDUCE,
+  "read", READ,
+  "load", LOAD,
+  "mapfile", MAPFILE,
+  "save", SAVE,
+  "func", FUNC,
+  "proc", PROC,
+  "return", RETURN,
+  "restore", RESTORE,
+  "time", TIME,
   0,0
 };
 
@@ -16,12 +16,10 @@ double Sqrt(double x) { return errcheck(sqrt(x), "sqrt"); }
 
 double Pow(double x, double y) { return errcheck(pow(x, y), "exponentiation"); }
 
-double integer(double x) { return (double)(long)x; }
+double integer(double x) { return trunc(x) + 0.0; } /* +0.0: -0 -> 0 */
 
 double Atan2(double x, double y) { return errcheck(atan2(y, x), "atan2"); }
 
-double Rand() { return (double)rand()/RAND_MAX; }
-
 double errcheck(double d, char *s) /* check result of library call */
 {
   if (errno == EDOM) {
@@ -0,0 +1,418 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 生成したコードの最適化
+ * 文(関数なら本体)のコードができたところで一度だけ行い、[start, progp) を書き換える。
+ *
+ * ループ不変式の移動
+ * whileの中で値の変わらない式は、ループに入って最初に評価したときの値を
+ * 隠れ変数に覚えておき、2回目からはそれを使う。
+ *
+ *   invreset t      ループに入る前に t を未計算にする (whilecode, forcode, forloopの直前)
+ *   invar t, L      t が計算済みなら値をpushして L へ
+ *   式のコード
+ *   invstore t      スタックの先頭を t に覚える
+ *   L:
+ *
+ * ループの外へ出して先に計算するのではなく最初に評価される場所で計算するので、
+ * ループを一度も回らないときや式がエラーになるときの動作は変わらない。
+ * ループの中で代入される変数 (assign, addeq, ++ などの相手) を使う式は不変ではない。
+ * 関数呼び出しなどがあると何が書き換わるかわからないので、定数だけの式に限る。
+ *
+ * 強さの低減
+ *   x^2, x^3, x^4        duptopとmulにする
+ *   x / 2のべき乗の定数    逆数の掛け算 (mul_k) にする (逆数が正確に表せるので結果は同じ)
+ */
+
+#define MINCOST 3 /* これより命令数の少ない式は覚えても得にならない */
+
+typedef struct Val { /* value on the simulated stack */
+  Inst *start;     /* first instruction of the expression */
+  Symbol *var;     /* varpush'ed symbol, not yet eval'ed */
+  int inv;         /* loop invariant */
+  int cost;        /* number of instructions */
+} Val;
+
+typedef struct Hoist {
+  Inst *from, *to; /* expression [from, to) */
+  Inst *loop;      /* whilecode etc. of the loop it is invariant in */
+  Symbol *tmp;
+} Hoist;
+
+typedef struct Opt {
+  Inst *start, *end;
+  char *target;    /* target[i]: start+i is a jump target */
+  Hoist *hoist;
+  int nhoist;
+  Symbol **written; /* variables assigned in the current loop */
+  int nwritten;
+  int allwritten;  /* call etc. in the loop: anything may change */
+  int argwritten;
+} Opt;
+
+extern double Rand(), Srand(), Normal(), Exponential(), Clock(), Cycles();
+
+#define BINOP_K(name, expr, swapped) name##_k,
+static Inst konst[] = { BINOPS(BINOP_K) 0 }; /* 右の値が定数の2項演算 */
+
+static int isconst(Inst f)
+{
+  int i;
+
+  for (i = 0; konst[i] && konst[i] != f; i++) {
+  }
+  return konst[i] != 0;
+}
+
+static int pure(Inst *p) /* instruction without side effects, pushes one value */
+{
+#define BINOP_PURE(name, expr, swapped) name,
+  static Inst ok[] = {
+    BINOPS(BINOP_PURE) power, negate, not, bltin, 0
+  };
+  static double (*random[])() = { Rand, Srand, Normal, Exponential, Clock, Cycles, 0 }; /* 乱数や時計は毎回違う */
+  int i;
+
+  for (i = 0; ok[i] && ok[i] != *p; i++) {
+  }
+  if (*p == bltin) {
+    for (i = 0; random[i]; i++) {
+      if ((double (*)())p[1] == random[i]) {
+        return 0;
+      }
+    }
+    return 1;
+  }
+  return ok[i] != 0 || isconst(*p);
+}
+
+static int nargs(Inst f) /* values popped by a pure instruction */
+{
+  return (f == negate || f == not || f == bltin || isconst(f)) ? 1 : 2;
+}
+
+static int written(Opt *o, Symbol *sp)
+{
+  int i;
+
+  if (o->allwritten) {
+    return 1;
+  }
+  for (i = 0; i < o->nwritten; i++) {
+    if (o->written[i] == sp) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void writeset(Opt *o, Inst *from, Inst *to) /* collect variables assigned in [from, to) */
+{
+  static Inst stores[] = {
+    assign, addeq, subeq, muleq, diveq,
+    pre_increment, post_increment, pre_decrement, post_decrement, 0
+  };
+  Inst *p, *prev = 0;
+  int i;
+
+  o->nwritten = o->allwritten = o->argwritten = 0;
+  for (p = from; p < to; prev = p, p += inst_len(p)) {
+    for (i = 0; stores[i] && stores[i] != *p; i++) {
+    }
+    if (stores[i]) {
+      if (prev && *prev == varpush) {
+        o->written[o->nwritten++] = (Symbol *)prev[1];
+      } else {
+        o->allwritten = 1;
+      }
+    } else if (*p == varread || *p == argstore) {
+      o->written[o->nwritten++] = (Symbol *)p[1];
+    } else if (*p == forloop) { /* ループ変数 */
+      o->written[o->nwritten++] = (Symbol *)p[3];
+    } else if (*p == argassign) {
+      o->argwritten = 1;
+    } else if (*p == call || *p == tailcall || *p == parforcode || *p == restorecode) {
+      o->allwritten = 1;
+    }
+  }
+}
+
+static void candidate(Opt *o, Val *v, Inst *end, Inst *loop) /* v is used by non-invariant code */
+{
+  Inst *p;
+  int i;
+
+  if (!v->inv || v->var || v->cost < MINCOST) {
+    return;
+  }
+  for (p = v->start + 1; p < end; p++) {
+    if (o->target[p - o->start]) {
+      return; /* 途中に飛び込まれる式は扱わない */
+    }
+  }
+  for (i = 0; i < o->nhoist; i++) { /* 外側のループで選んだ式と入れ子でなく重なるものは捨てる */
+    Hoist *h = &o->hoist[i];
+    int inside = h->from <= v->start && end <= h->to;
+    int outside = v->start <= h->from && h->to <= end;
+    if (v->start < h->to && h->from < end && inside == outside) {
+      return;
+    }
+  }
+  o->hoist[o->nhoist].from = v->start;
+  o->hoist[o->nhoist].to = end;
+  o->hoist[o->nhoist].loop = loop;
+  o->hoist[o->nhoist].tmp = 0;
+  o->nhoist++;
+}
+
+static void flush(Opt *o, Val *stk, int n, Inst *p, Inst *loop) /* everything on the stack is used by p */
+{
+  int i;
+
+  for (i = 0; i < n; i++) {
+    candidate(o, &stk[i], i + 1 < n ? stk[i+1].start : p, loop);
+  }
+}
+
+static void loop(Opt *o, Inst *w) /* find invariant expressions of the loop at w */
+{
+  /* while, for, forloopはどれも次の文へのポインタが2つ目で、条件式などが続く */
+  Inst *from = w + inst_len(w), *to = *((Inst **)(w + 2)), *p;
+  Val *stk;
+  Val v;
+  int n = 0, k;
+
+  if (to < from || to > o->end) { /* 行き先が文の外のコードは扱わない */
+    return;
+  }
+  stk = (Val *)ctalloc((to - from + 1) * sizeof(Val));
+  writeset(o, from, to);
+  if (*w == forloop) {
+    o->written[o->nwritten++] = (Symbol *)w[3];
+  }
+  for (p = from; p < to; p += inst_len(p)) {
+    v.start = p;
+    v.var = 0;
+    v.inv = 0;
+    v.cost = 1;
+    if (*p == constpush || *p == fieldpush) {
+      v.inv = 1;
+    } else if (*p == varpush) {
+      v.var = (Symbol *)p[1];
+    } else if (*p == arg) {
+      v.inv = !o->argwritten && !o->allwritten;
+    } else if (*p == tmpval) {
+      v.inv = !written(o, (Symbol *)p[1]);
+    } else if (*p == eval && n > 0 && stk[n-1].var) {
+      v = stk[--n];
+      v.inv = v.var->type == VAR && !written(o, v.var); /* 導出変数や未定義の変数は毎回読む */
+      v.var = 0;
+      v.cost = 2;
+    } else if (pure(p) && n >= nargs(*p)) {
+      k = nargs(*p);
+      n -= k;
+      v = stk[n];
+      v.inv = stk[n].inv && (k == 1 || stk[n+1].inv) && !stk[n].var && (k == 1 || !stk[n+1].var);
+      v.cost = stk[n].cost + (k == 2 ? stk[n+1].cost : 0) + 1;
+      if (!v.inv) {
+        flush(o, &stk[n], k, p, w);
+      }
+    } else { /* それ以外の命令: スタック上の値はすべてここで使われる */
+      flush(o, stk, n, p, w);
+      n = 0;
+    }
+    stk[n++] = v;
+  }
+}
+
+static int powerof2(double x) /* x = ±2^k and 1/x = ±2^-k is a normal double, so it is exact */
+{
+  int e;
+  /* x = 0.5 * 2^e なので 1/x = 2^(1-e) 非正規化数や無限大になる k は除く */
+  return x != 0.0 && isfinite(x) && fabs(frexp(x, &e)) == 0.5 && e >= -1022 && e <= 1023;
+}
+
+static int reduce(Opt *o, Inst *p, Inst *q) /* strength reduction of "constpush c; power" and "divide_k c" */
+{
+  Datum c;
+
+  if (*p == divide_k) {
+    return powerof2(num(((Symbol *)p[1])->u.v)) ? '/' : 0;
+  }
+  if (*p != constpush || q >= o->end || o->target[q - o->start]) {
+    return 0;
+  }
+  c = ((Symbol *)p[1])->u.v;
+  if (*q == power) {
+    return ISINT(c) && INTVAL(c) >= 2 && INTVAL(c) <= 4 ? 'p' : 0;
+  }
+  return 0;
+}
+
+static int cmphoist(const void *a, const void *b) /* by start, longer first */
+{
+  const Hoist *x = a, *y = b;
+  if (x->from != y->from) {
+    return x->from < y->from ? -1 : 1;
+  }
+  return x->to > y->to ? -1 : x->to < y->to;
+}
+
+static Symbol *newtmp(void)
+{
+  Symbol *sp = (Symbol *)ctalloc(sizeof(Symbol));
+  sp->name = "invariant";
+  sp->type = UNDEF;
+  sp->u.v = mkint(0);
+  sp->users = 0;
+  sp->next = 0;
+  return sp;
+}
+
+void optimize(Inst *start) /* optimize [start, progp) in place */
+{
+  HocVM *vm = curvm;
+  Inst *end = vm->progp, *p, *q, *buf;
+  long n = end - start, *map, len = 0;
+  Hoist **open;
+  const char *ops;
+  Opt o;
+  int i, j, h, nopen = 0, r;
+
+  if (n <= 0) {
+    return;
+  }
+  o.start = start;
+  o.end = end;
+  o.target = (char *)ctalloc(n + 1);
+  o.hoist = (Hoist *)ctalloc(n * sizeof(Hoist));
+  o.written = (Symbol **)ctalloc(n * sizeof(Symbol *));
+  o.nhoist = 0;
+  memset(o.target, 0, n + 1);
+  for (p = start; p < end; p += inst_len(p)) {
+    for (ops = inst_operands(*p), i = 1; *ops; ops++, i++) {
+      Inst *a = (Inst *)p[i];
+      if (*ops == 'a' && a >= start && a <= end) {
+        o.target[a - start] = 1;
+      }
+    }
+  }
+  for (p = start; p < end; p += inst_len(p)) { /* 外側のループから */
+    if (*p == whilecode || *p == forcode || *p == forloop) {
+      loop(&o, p);
+    }
+  }
+  qsort(o.hoist, o.nhoist, sizeof(Hoist), cmphoist);
+  for (i = 0; i < o.nhoist; i++) {
+    o.hoist[i].tmp = newtmp();
+  }
+
+  /* 書き換えたコードをbufに作る アドレスは元のまま置き、最後にmapで付け替える */
+  buf = (Inst *)ctalloc((4 * n + 8) * sizeof(Inst));
+  map = (long *)ctalloc((n + 1) * sizeof(long));
+  open = (Hoist **)ctalloc((o.nhoist + 1) * sizeof(Hoist *));
+  for (p = start, h = 0; ; p = q) {
+    while (nopen > 0 && open[nopen-1]->to == p) {
+      buf[len++] = invstore;
+      buf[len++] = (Inst)open[--nopen]->tmp;
+    }
+    map[p - start] = len;
+    if (p >= end) {
+      break;
+    }
+    for (i = 0; i < o.nhoist; i++) {
+      if (o.hoist[i].loop == p) {
+        buf[len++] = invreset;
+        buf[len++] = (Inst)o.hoist[i].tmp;
+      }
+    }
+    for (; h < o.nhoist && o.hoist[h].from == p; h++) {
+      buf[len++] = invar;
+      buf[len++] = (Inst)o.hoist[h].tmp;
+      buf[len++] = (Inst)o.hoist[h].to; /* invstoreの後ろ 元のアドレスで */
+      open[nopen++] = &o.hoist[h];
+    }
+    q = p + inst_len(p);
+    if ((r = reduce(&o, p, q)) != 0) {
+      Datum c = ((Symbol *)p[1])->u.v;
+      if (r == '/') {
+        buf[len++] = mul_k;
+        buf[len++] = (Inst)constsym(1.0 / num(c));
+        continue;
+      }
+      if (INTVAL(c) == 2) {
+        buf[len++] = duptop;
+        buf[len++] = mul;
+      } else if (INTVAL(c) == 3) {
+        buf[len++] = duptop;
+        buf[len++] = duptop;
+        buf[len++] = mul;
+        buf[len++] = mul;
+      } else {
+        buf[len++] = duptop;
+        buf[len++] = mul;
+        buf[len++] = duptop;
+        buf[len++] = mul;
+      }
+      map[q - start] = len;
+      q += inst_len(q);
+      continue;
+    }
+    for (i = 0; i < q - p; i++) {
+      buf[len++] = p[i];
+    }
+  }
+  if (start + len >= &vm->prog[NPROG]) {
+    return; /* 入りきらなければ最適化しない */
+  }
+  for (i = 0; i < len; i += 1 + strlen(ops)) {
+    ops = inst_operands(buf[i]);
+    for (j = 0; ops[j]; j++) {
+      Inst *a = (Inst *)buf[i + 1 + j];
+      if (ops[j] == 'a' && a >= start && a <= end) {
+        buf[i + 1 + j] = (Inst)(start + map[a - start]);
+      }
+    }
+  }
+  memcpy(start, buf, len * sizeof(Inst));
+  vm->progp = start + len;
+}
+
+void invreset(void) /* forget the value of a loop invariant */
+{
+  ((Symbol *)*curvm->pc++)->type = UNDEF;
+}
+
+void invar(void) /* push the remembered value and skip the expression */
+{
+  HocVM *vm = curvm;
+  Symbol *sp = (Symbol *)vm->pc[0];
+
+  if (sp->type == VAR) {
+    push(sp->u.v);
+    vm->pc = *((Inst **)(vm->pc + 1));
+  } else {
+    vm->pc += 2;
+  }
+}
+
+void invstore(void) /* remember the value on top of the stack */
+{
+  HocVM *vm = curvm;
+  Symbol *sp = (Symbol *)*vm->pc++;
+
+  sp->u.v = vm->stackp[-1];
+  sp->type = VAR;
+}
+
+void duptop(void) /* duplicate top of stack */
+{
+  Datum d;
+  d = pop();
+  push(d);
+  push(d);
+}
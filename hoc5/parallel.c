@@ -0,0 +1,440 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * parallel for (i = a; i < b; i++) reduce(+ s, max m) stmt
+ *
+ * 反復空間を NCHUNK 個以下のチャンクに分け、ワーカースレッドで実行する。
+ * スレッドプールはプロセスに1つで、最初の parallel for で作る。デーモンの接続や
+ * -j のプログラムがいくつあってもスレッドは増えず、ジョブは1つずつ順に実行する。
+ * 各ワーカーは自分の担当チャンクを前から取り、無くなったら他のワーカーの
+ * 担当分を後ろから盗む (work stealing)。
+ * 本体で使う変数はチャンクごとに親の値で初期化したワーカー専用の複製になり、
+ * 親の変数には書き戻さない。本体から呼ぶ関数もワーカーごとに複製し、その中の
+ * 変数も同じ複製に付け替えるので、関数の中で大域変数に書いても他のスレッドと
+ * 競合しない。導出変数は親のVMの依存関係にしかつながっていないので、本体では読めない。リダクション変数だけはチャンクごとの部分結果を
+ * チャンクの順に親の値へ合成するので、スレッド数や実行順によらず結果は同じになる。
+ * print の出力もチャンクごとにためておき、チャンクの順に出力する。
+ * 乱数もチャンクごとに親から決めた種を使う。
+ * 実行の予算は親の残りをチャンクの数で等分して各チャンクに持たせ、
+ * チャンクが実際に実行した命令数を終わってから親の予算から引く。
+ */
+
+#define NCHUNK 256 /* max number of chunks, independent of thread count */
+
+typedef struct Chunk {
+  long lo, hi;    /* iterations [lo, hi) */
+  int failed;
+  char *out;      /* print output of this chunk */
+  size_t outlen;
+  long insts;     /* instructions executed */
+} Chunk;
+
+typedef struct Job {
+  Inst *body, *end; /* loop body [body, end) */
+  Symbol *var;      /* loop variable */
+  Reduce *red;
+  int nred;
+  Datum start;      /* value of var at iteration 0 */
+  uint64_t seed;    /* chunk c uses random seed seed+c */
+  Chunk *chunks;
+  int nchunks;
+  Datum *partial;   /* partial[c*nred + r] */
+  int lineno;       /* for error messages */
+  long insts;       /* 各チャンクの実行の予算 0なら無制限 */
+  double deadline;
+  volatile int failed;
+} Job;
+
+typedef struct Worker {
+  pthread_t tid;
+  struct Pool *pool;
+  HocVM *vm;
+  pthread_mutex_t mu;
+  int head, tail;   /* chunks still owned by this worker [head, tail) */
+  Symbol **orig;    /* shared symbols used by the body */
+  Symbol **priv;    /* private copies, same index as orig */
+  int npriv, maxpriv;
+  Arena arena;      /* private copies and the functions they call */
+} Worker;
+
+typedef struct Pool {
+  int n;
+  Worker *w;
+  pthread_mutex_t mu;
+  pthread_cond_t work, done;
+  long generation;  /* incremented for each job */
+  int pending;      /* workers still running the job */
+  int quit;
+  Job *job;
+} Pool;
+
+static Pool *procpool;  /* 0 until the first parallel for */
+static pthread_mutex_t poolmu = PTHREAD_MUTEX_INITIALIZER; /* held while a job runs */
+
+Reduce *newreduce(int op, Symbol *sym, Reduce *next)
+{
+  Reduce *r = (Reduce *)ctalloc(sizeof(Reduce));
+  r->op = op;
+  r->sym = sym;
+  r->next = next;
+  return r;
+}
+
+static Datum identity(int op)
+{
+  switch (op) {
+    case '*': return mkint(1);
+    case 'm': return mknum(HUGE_VAL);
+    case 'M': return mknum(-HUGE_VAL);
+    default: return mkint(0);
+  }
+}
+
+static Datum combine(int op, Datum a, Datum b)
+{
+  switch (op) {
+    case '*': return mulv(a, b);
+    case 'm': return num(b) < num(a) ? b : a;
+    case 'M': return num(b) > num(a) ? b : a;
+    default: return addv(a, b);
+  }
+}
+
+static Datum iteration(Datum start, long k) /* value of the loop variable at iteration k */
+{
+  return ISINT(start) ? mkinteger(INTVAL(start) + k) : mknum(num(start) + k);
+}
+
+static int isfunc(Symbol *sp)
+{
+  return (sp->type == FUNCTION || sp->type == PROCEDURE) && sp->u.fn;
+}
+
+static Symbol *privatize(Symbol *sp, void *arg) /* map shared variable or function to worker copy */
+{
+  Worker *w = (Worker *)arg;
+  Symbol *p;
+  Func *fn;
+  int i;
+
+  if (sp->type != VAR && sp->type != UNDEF && !isfunc(sp)) {
+    return sp; /* 数値定数などはそのまま共有 */
+  }
+  for (i = 0; i < w->npriv; i++) {
+    if (w->orig[i] == sp) {
+      return w->priv[i];
+    }
+  }
+  if (w->npriv >= w->maxpriv) {
+    w->maxpriv = w->maxpriv ? 2 * w->maxpriv : 64;
+    w->orig = (Symbol **)realloc(w->orig, w->maxpriv * sizeof(Symbol *));
+    w->priv = (Symbol **)realloc(w->priv, w->maxpriv * sizeof(Symbol *));
+    if (w->orig == 0 || w->priv == 0) {
+      execerror("out of memory", (char *) 0);
+    }
+  }
+  p = (Symbol *)arena_alloc(&w->arena, sizeof(Symbol));
+  *p = *sp;
+  p->next = 0;
+  p->users = 0; /* 導出変数は親のVMのもの */
+  w->orig[w->npriv] = sp;
+  w->priv[w->npriv++] = p;
+  if (isfunc(sp)) { /* 先に登録してあるので再帰呼び出しは同じ複製を指す */
+    fn = (Func *)arena_alloc(&w->arena, sizeof(Func));
+    *fn = *sp->u.fn;
+    fn->code = (Inst *)arena_alloc(&w->arena, fn->len * sizeof(Inst));
+    p->u.fn = fn;
+    codecopy(fn->code, sp->u.fn->code, sp->u.fn->code + fn->len, privatize, w);
+  }
+  return p;
+}
+
+static void setup(Worker *w, Job *job) /* copy the body into this worker's machine */
+{
+  w->npriv = 0;
+  w->vm->lineno = job->lineno;
+  codecopy(w->vm->prog, job->body, job->end, privatize, w);
+  w->vm->prog[job->end - job->body] = STOP;
+}
+
+static void runchunk(Worker *w, Job *job, int c)
+{
+  HocVM *vm = w->vm;
+  Chunk *ch = &job->chunks[c];
+  Symbol *var;
+  Reduce *r;
+  long k, insts;
+  int i;
+
+  vm->fout = open_memstream(&ch->out, &ch->outlen);
+  vm_budget(vm, job->insts, job->deadline);
+  insts = vm_insts(vm);
+  if (setjmp(vm->begin)) { /* privatizeのエラーもここへ来る */
+    ch->failed = job->failed = 1;
+    ch->insts = vm_insts(vm) - insts;
+    fclose(vm->fout);
+    return;
+  }
+  for (i = 0; i < w->npriv; i++) { /* firstprivate */
+    if (!isfunc(w->orig[i])) {
+      w->priv[i]->type = w->orig[i]->type;
+      w->priv[i]->u = w->orig[i]->u;
+    }
+  }
+  for (r = job->red; r; r = r->next) {
+    Symbol *sp = privatize(r->sym, w);
+    sp->type = VAR;
+    sp->u.v = identity(r->op);
+  }
+  var = privatize(job->var, w);
+  vm_srand(vm, job->seed + c);
+  for (k = ch->lo; k < ch->hi && !job->failed; k++) {
+    var->type = VAR;
+    var->u.v = iteration(job->start, k);
+    initstack();
+    execute(vm->prog);
+  }
+  for (r = job->red, i = 0; r; r = r->next, i++) {
+    job->partial[c * job->nred + i] = privatize(r->sym, w)->u.v;
+  }
+  ch->insts = vm_insts(vm) - insts;
+  fclose(vm->fout);
+}
+
+static int takechunk(Pool *pool, int self) /* own chunks from the front, others' from the back */
+{
+  Worker *w;
+  int i, c = -1;
+
+  for (i = 0; i < pool->n && c < 0; i++) {
+    w = &pool->w[(self + i) % pool->n];
+    pthread_mutex_lock(&w->mu);
+    if (w->head < w->tail) {
+      c = (i == 0) ? w->head++ : --w->tail;
+    }
+    pthread_mutex_unlock(&w->mu);
+  }
+  return c;
+}
+
+static void *workermain(void *arg)
+{
+  Worker *w = (Worker *)arg;
+  Pool *pool = w->pool;
+  volatile long seen = 0; /* setjmpのあとも使う */
+  Job *job;
+  int c;
+
+  curvm = w->vm;
+  for (;;) {
+    pthread_mutex_lock(&pool->mu);
+    while (pool->generation == seen && !pool->quit) {
+      pthread_cond_wait(&pool->work, &pool->mu);
+    }
+    if (pool->quit) {
+      pthread_mutex_unlock(&pool->mu);
+      break;
+    }
+    seen = pool->generation;
+    job = pool->job;
+    pthread_mutex_unlock(&pool->mu);
+
+    if (setjmp(w->vm->begin) == 0) {
+      setup(w, job);
+      while ((c = takechunk(pool, w - pool->w)) >= 0) {
+        runchunk(w, job, c);
+      }
+    } else {
+      job->failed = 1;
+    }
+    arena_reset(&w->arena);
+
+    pthread_mutex_lock(&pool->mu);
+    if (--pool->pending == 0) {
+      pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->mu);
+  }
+  return 0;
+}
+
+static int nthreads(void)
+{
+  char *s = getenv("HOC_THREADS");
+  long n = s ? atol(s) : sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? (int)n : 1;
+}
+
+static Pool *newpool(void) /* 0 if out of memory */
+{
+  Pool *pool = (Pool *)malloc(sizeof(Pool));
+  int i;
+
+  if (pool == 0) {
+    return 0;
+  }
+  pool->n = nthreads();
+  if ((pool->w = (Worker *)calloc(pool->n, sizeof(Worker))) == 0) {
+    free(pool);
+    return 0;
+  }
+  for (i = 0; i < pool->n; i++) {
+    if ((pool->w[i].vm = vm_create()) == 0) {
+      while (--i >= 0) {
+        vm_free(pool->w[i].vm);
+      }
+      free(pool->w);
+      free(pool);
+      return 0;
+    }
+  }
+  pthread_mutex_init(&pool->mu, 0);
+  pthread_cond_init(&pool->work, 0);
+  pthread_cond_init(&pool->done, 0);
+  pool->generation = 0;
+  pool->pending = 0;
+  pool->quit = 0;
+  pool->job = 0;
+  for (i = 0; i < pool->n; i++) {
+    Worker *w = &pool->w[i];
+    w->pool = pool;
+    w->vm->inparallel = 1;
+    w->orig = 0;
+    w->priv = 0;
+    w->maxpriv = 0;
+    arena_init(&w->arena, 4096);
+    pthread_mutex_init(&w->mu, 0);
+    pthread_create(&w->tid, 0, workermain, w);
+  }
+  return pool;
+}
+
+static void runjob(Pool *pool, Job *job, HocVM *parent)
+{
+  int i;
+
+  for (i = 0; i < pool->n; i++) { /* 最初はチャンクを均等に割り当てる */
+    HocVM *vm = pool->w[i].vm; /* 設定はジョブを出したVMに合わせる */
+    vm->trace = parent->trace;
+    vm->ferr = parent->ferr;
+    vm->name = parent->name;
+    vm->nofiles = parent->nofiles;
+    pool->w[i].head = (long)job->nchunks * i / pool->n;
+    pool->w[i].tail = (long)job->nchunks * (i + 1) / pool->n;
+  }
+  pthread_mutex_lock(&pool->mu);
+  pool->job = job;
+  pool->pending = pool->n;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->done, &pool->mu);
+  }
+  pool->job = 0;
+  pthread_mutex_unlock(&pool->mu);
+}
+
+void parforcode(void)
+{
+  /*
+  [n]   parforcode命令
+  [n+1] ループ変数
+  [n+2] リダクションのリスト
+  [n+3] 上限式へのポインタ
+  [n+4] 本体へのポインタ
+  [n+5] 次の文へのポインタ
+  [n+6] 初期値式コード
+   */
+  HocVM *vm = curvm;
+  Inst *savepc = vm->pc;
+  Job job;
+  Reduce *r;
+  double hi;
+  long n, insts;
+  int c, i;
+
+  if (vm->inparallel) {
+    execerror("nested parallel for", (char *) 0);
+  }
+  job.lineno = vm->lineno;
+  job.var = (Symbol *)savepc[0];
+  job.red = (Reduce *)savepc[1];
+  job.body = *((Inst **)(savepc+3));
+  job.end = *((Inst **)(savepc+4)) - 1; /* 本体の後ろのSTOPは含めない */
+  execute(savepc+5);
+  job.start = pop();
+  execute(*((Inst **)(savepc+2)));
+  hi = num(pop());
+  for (job.nred = 0, r = job.red; r; r = r->next, job.nred++) {
+    if (r->sym->type != VAR) {
+      execerror("undefined reduction variable ", r->sym->name);
+    }
+  }
+  job.seed = vm_random(vm);
+  job.deadline = vm->deadline;
+  n = hi > num(job.start) ? (long)ceil(hi - num(job.start)) : 0;
+
+  if (n > 0) {
+    job.nchunks = n < NCHUNK ? (int)n : NCHUNK;
+    job.chunks = (Chunk *)emalloc(job.nchunks * sizeof(Chunk));
+    job.partial = (Datum *)emalloc((job.nchunks * job.nred + 1) * sizeof(Datum));
+    job.failed = 0;
+    job.insts = 0;
+    if (vm->ileft >= 0) { /* 残りをチャンクで分ける */
+      job.insts = (vm->ileft + vm->steps) / job.nchunks;
+      job.insts = job.insts > 0 ? job.insts : 1;
+    }
+    for (c = 0; c < job.nchunks; c++) {
+      job.chunks[c].lo = n * c / job.nchunks;
+      job.chunks[c].hi = n * (c + 1) / job.nchunks;
+      job.chunks[c].failed = 0;
+      job.chunks[c].out = 0;
+      job.chunks[c].outlen = 0;
+      job.chunks[c].insts = 0;
+    }
+    pthread_mutex_lock(&poolmu);
+    if (procpool == 0 && (procpool = newpool()) == 0) {
+      pthread_mutex_unlock(&poolmu);
+      free(job.chunks);
+      free(job.partial);
+      execerror("out of memory", (char *) 0);
+    }
+    runjob(procpool, &job, vm);
+    pthread_mutex_unlock(&poolmu);
+    for (insts = 0, c = 0; c < job.nchunks; c++) { /* ワーカーが使った分を親の予算から引く */
+      insts += job.chunks[c].insts;
+    }
+    vm_charge(vm, insts);
+
+    for (c = 0; c < job.nchunks && !job.chunks[c].failed; c++) {
+      if (job.chunks[c].out) {
+        fwrite(job.chunks[c].out, 1, job.chunks[c].outlen, vm->fout);
+      }
+    }
+    if (!job.failed) {
+      for (r = job.red, i = 0; r; r = r->next, i++) {
+        for (c = 0; c < job.nchunks; c++) {
+          r->sym->u.v = combine(r->op, r->sym->u.v, job.partial[c * job.nred + i]);
+        }
+        changed(r->sym);
+      }
+    }
+    for (c = 0; c < job.nchunks; c++) {
+      free(job.chunks[c].out);
+    }
+    free(job.chunks);
+    free(job.partial);
+    if (job.failed) {
+      execerror("parallel for", " failed");
+    }
+  }
+  job.var->type = VAR;
+  job.var->u.v = iteration(job.start, n);
+  changed(job.var);
+  vm->pc = *((Inst **)(savepc+4)); /* next statement */
+}
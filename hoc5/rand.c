@@ -0,0 +1,118 @@
+#include "hoc.h"
+#include <math.h>
+
+/*
+ * 乱数 (xoshiro256++)
+ * 状態はVMごとに持つので、スレッドごとに独立した系列になり、ロックもいらない。
+ * rand()は一様乱数をNRANDずつまとめて作ったバッファから1つずつ返す。
+ * parallel for ではチャンクごとに親から決めた種を使うので、
+ * スレッド数によらず同じ乱数列になる。
+ *
+ *   rand(x)         [0, 1) の一様乱数 (xは使わない)
+ *   srand(seed)     種を設定する
+ *   normal(s)       平均0 標準偏差sの正規乱数
+ *   exponential(m)  平均mの指数乱数
+ */
+
+static uint64_t rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t splitmix64(uint64_t *x) /* 種から状態を作るのに使う */
+{
+  uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+uint64_t vm_random(HocVM *vm) /* next 64 random bits */
+{
+  uint64_t *s = vm->rs;
+  uint64_t r = rotl(s[0] + s[3], 23) + s[0];
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return r;
+}
+
+void vm_srand(HocVM *vm, uint64_t seed)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    vm->rs[i] = splitmix64(&seed);
+  }
+  vm->rnext = NRAND; /* バッファは空 */
+  vm->hasnormal = 0;
+}
+
+void vm_randfill(HocVM *vm, double *buf, size_t n) /* n uniform numbers in [0, 1) */
+{
+  uint64_t s0 = vm->rs[0], s1 = vm->rs[1], s2 = vm->rs[2], s3 = vm->rs[3], t;
+  size_t i;
+
+  /* 状態をレジスタに置いたまま回す */
+  for (i = 0; i < n; i++) {
+    buf[i] = (double)((rotl(s0 + s3, 23) + s0) >> 11) * 0x1.0p-53;
+    t = s1 << 17;
+    s2 ^= s0;
+    s3 ^= s1;
+    s1 ^= s2;
+    s0 ^= s3;
+    s2 ^= t;
+    s3 = rotl(s3, 45);
+  }
+  vm->rs[0] = s0;
+  vm->rs[1] = s1;
+  vm->rs[2] = s2;
+  vm->rs[3] = s3;
+}
+
+static double uniform(HocVM *vm)
+{
+  if (vm->rnext >= NRAND) {
+    vm_randfill(vm, vm->rbuf, NRAND);
+    vm->rnext = 0;
+  }
+  return vm->rbuf[vm->rnext++];
+}
+
+double Rand(double x) { (void)x; return uniform(curvm); }
+
+double Srand(double seed)
+{
+  vm_srand(curvm, (uint64_t)(int64_t)seed);
+  return seed;
+}
+
+double Normal(double sd) /* polar method, the second value is kept for the next call */
+{
+  HocVM *vm = curvm;
+  double u, v, s;
+
+  if (vm->hasnormal) {
+    vm->hasnormal = 0;
+    return vm->normal * sd;
+  }
+  do {
+    u = 2 * uniform(vm) - 1;
+    v = 2 * uniform(vm) - 1;
+    s = u * u + v * v;
+  } while (s >= 1 || s == 0);
+  s = sqrt(-2 * log(s) / s);
+  vm->normal = v * s;
+  vm->hasnormal = 1;
+  return u * s * sd;
+}
+
+double Exponential(double mean)
+{
+  return -log1p(-uniform(curvm)) * mean;
+}
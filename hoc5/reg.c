@@ -0,0 +1,617 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * レジスタマシン  hoc5 -R
+ *
+ * 翻訳した文のスタックマシンのコードを、実行する前に3番地の命令 (RegOp) に直す。
+ *   x = a*b + c   varpush a, eval, varpush b, eval, mul, varpush c, eval, add,
+ *                 varpush x, assign, popstack
+ *             ->  MUL r0, a, b
+ *                 ADD x, r0, c
+ * 変数と定数はシンボルの値をそのままレジスタとして読み書きし、途中の値は
+ * スタックの深さと同じ番号のレジスタ r0, r1, ... に置く。
+ * 値の計算はスタックマシンと同じ関数 (addvなど) なので、整数と実数の扱いや
+ * エラーメッセージは変わらない。
+ *
+ * スタックに積んだだけでまだ使っていない変数は、その変数に代入する前と、
+ * 関数呼び出しや分岐の前にレジスタに写す。
+ * 関数呼び出し・$n・read() などは、その命令だけのスタックマシンのコードを作り
+ * 引数を積んで実行する (関数の本体はスタックマシンで動く)。
+ * 直せない文 (parallel for や導出変数を読むもの) はそのままスタックマシンで実行する。
+ */
+
+#define REG_ENUM(name, expr, swapped) R_##name,
+enum {
+  BINOPS(REG_ENUM)
+  R_MOVE, R_NEG, R_POW, R_NOT, R_TRUTH, R_BLTIN, R_CHECK,
+  R_JUMP, R_FALSE, R_AND, R_OR, R_INVRESET, R_INVAR, R_INVSTORE,
+  R_PRINT, R_PREXPR, R_STACK, R_FORTEST, R_FORNEXT
+};
+
+#define REG_NAME(name, expr, swapped) #name,
+static const char *opname[] = {
+  BINOPS(REG_NAME)
+  "move", "neg", "pow", "not", "truth", "bltin", "check",
+  "jump", "false", "and", "or", "invreset", "invar", "invstore",
+  "print", "prexpr", "stack", "fortest", "fornext"
+};
+
+typedef struct RegOp {
+  int op;
+  Datum *d, *a, *b;   /* 結果と2つのオペランド */
+  Symbol *store;      /* dはこの変数の値: 書いたらVARにしてchanged() */
+  Symbol *sym;        /* R_CHECK, R_INV*, R_FOR*のループ変数 */
+  Symbol *lim, *inc;  /* R_FOR*: 上限と増分 */
+  int cmp, down;
+  int to;             /* jump target */
+  const char *msg;    /* R_CHECK: symがVARでなければこのエラー */
+  double (*f)();      /* R_BLTIN */
+  Inst code[4];       /* R_STACK: 実行するスタックマシンのコード */
+  int args, nargs;    /* R_STACK: 先に積む値 argv[args...] */
+  int nres;           /* R_STACK: 結果をdにpopするか */
+} RegOp;
+
+typedef struct Item {  /* 翻訳中のスタック */
+  Datum *v;           /* 値のある場所 */
+  Symbol *var;        /* vはこの変数の値 (まだ読んでいない) */
+  Symbol *sym;        /* varpushした変数 */
+} Item;
+
+typedef struct RegCode {
+  RegOp *op;
+  int nop, maxop;
+  int mark;           /* ここより前の命令の結果は行き先を変えられない (飛び先) */
+  Datum **argv;
+  int nargv, maxargv;
+  Item stack[NSTACK];
+  int sp;
+  Datum r[NSTACK];    /* registers */
+  Datum one;
+  jmp_buf fail;
+  long nlowered, nfallback, nrun;
+} RegCode;
+
+static struct {
+  Inst op, op_k;
+  int rop;
+} binops[] = {
+#define REG_BINOP(name, expr, swapped) { name, name##_k, R_##name },
+  BINOPS(REG_BINOP)
+  { 0, 0, 0 }
+};
+
+static void *grow(RegCode *rc, void *p, int *max, int n, size_t size)
+{
+  if (n >= *max) {
+    *max = *max ? 2 * *max : 64;
+    if ((p = realloc(p, *max * size)) == 0) {
+      longjmp(rc->fail, 1);
+    }
+  }
+  return p;
+}
+
+static RegOp *emit(RegCode *rc, int op, Datum *d, Datum *a, Datum *b)
+{
+  RegOp *o;
+
+  rc->op = grow(rc, rc->op, &rc->maxop, rc->nop, sizeof(RegOp));
+  o = &rc->op[rc->nop++];
+  memset(o, 0, sizeof(RegOp));
+  o->op = op;
+  o->d = d;
+  o->a = a;
+  o->b = b;
+  return o;
+}
+
+static int label(RegCode *rc) /* the next op is a jump target */
+{
+  rc->mark = rc->nop;
+  return rc->nop;
+}
+
+static void push1(RegCode *rc, Datum *v, Symbol *var, Symbol *sym)
+{
+  if (rc->sp >= NSTACK) {
+    longjmp(rc->fail, 1);
+  }
+  rc->stack[rc->sp].v = v;
+  rc->stack[rc->sp].var = var;
+  rc->stack[rc->sp++].sym = sym;
+}
+
+static Datum *temp(RegCode *rc) /* register for a value pushed now */
+{
+  if (rc->sp >= NSTACK) {
+    longjmp(rc->fail, 1);
+  }
+  return &rc->r[rc->sp];
+}
+
+static Item pop1(RegCode *rc)
+{
+  if (rc->sp <= 0) {
+    longjmp(rc->fail, 1);
+  }
+  return rc->stack[--rc->sp];
+}
+
+static Datum *popval(RegCode *rc)
+{
+  Item it = pop1(rc);
+
+  if (it.v == 0) {
+    longjmp(rc->fail, 1);
+  }
+  return it.v;
+}
+
+static Symbol *popsym(RegCode *rc)
+{
+  Item it = pop1(rc);
+
+  if (it.sym == 0) {
+    longjmp(rc->fail, 1);
+  }
+  return it.sym;
+}
+
+static void spill(RegCode *rc, Symbol *sp) /* copy stacked reads of sp (0: any variable) to registers */
+{
+  Item *it;
+
+  for (it = rc->stack; it < rc->stack + rc->sp; it++) {
+    if (it->var && (sp == 0 || it->var == sp)) {
+      emit(rc, R_MOVE, &rc->r[it - rc->stack], it->v, 0);
+      it->v = &rc->r[it - rc->stack];
+      it->var = 0;
+    }
+  }
+}
+
+static void check(RegCode *rc, Symbol *sp, const char *msg) /* sp must be VAR when the code runs */
+{
+  RegOp *o;
+
+  if (sp->type == VAR) {
+    return;
+  }
+  if (sp->type != UNDEF) {
+    longjmp(rc->fail, 1); /* スタックマシンでエラーにする */
+  }
+  o = emit(rc, R_CHECK, 0, 0, 0);
+  o->sym = sp;
+  o->msg = msg;
+}
+
+static void store(RegCode *rc, Symbol *sp, int op, Datum *a, Datum *b) /* sp = a op b, push sp */
+{
+  RegOp *last = rc->nop > rc->mark ? &rc->op[rc->nop - 1] : 0;
+  Item *it;
+  int folded = 0;
+
+  /* 直前の命令の結果をそのまま代入するなら、その命令が変数に書く */
+  if (op == R_MOVE && last && last->d == a && a == &rc->r[rc->sp] && last->store == 0 &&
+      last->op <= R_BLTIN) {
+    folded = 1;
+    for (it = rc->stack; it < rc->stack + rc->sp; it++) {
+      if (it->var == sp || it->v == a) {
+        folded = 0;
+      }
+    }
+  }
+  if (folded) {
+    last->d = &sp->u.v;
+    last->store = sp;
+  } else {
+    spill(rc, sp);
+    emit(rc, op, &sp->u.v, a, b)->store = sp;
+  }
+  push1(rc, &sp->u.v, sp, 0);
+}
+
+static void stack(RegCode *rc, Inst *p, int nargs, int nres) /* run the instruction at p on the stack machine */
+{
+  RegOp *o;
+  Datum *d;
+  int i, n = inst_len(p);
+
+  rc->argv = grow(rc, rc->argv, &rc->maxargv, rc->nargv + nargs, sizeof(Datum *));
+  for (i = nargs - 1; i >= 0; i--) {
+    rc->argv[rc->nargv + i] = popval(rc);
+  }
+  d = nres ? temp(rc) : 0;
+  o = emit(rc, R_STACK, d, 0, 0);
+  for (i = 0; i < n; i++) {
+    o->code[i] = p[i];
+  }
+  o->code[n] = STOP;
+  o->args = rc->nargv;
+  o->nargs = nargs;
+  o->nres = nres;
+  rc->nargv += nargs;
+  if (nres) {
+    push1(rc, d, 0, 0);
+  }
+}
+
+static RegOp *forop(RegCode *rc, int op, Inst *p) /* R_FORTEST or R_FORNEXT of the forloop at p */
+{
+  RegOp *o = emit(rc, op, 0, 0, 0);
+
+  o->sym = (Symbol *)p[3];
+  o->lim = (Symbol *)p[4];
+  o->inc = (Symbol *)p[5];
+  o->cmp = (int)(long)p[6];
+  o->down = (int)(long)p[7];
+  return o;
+}
+
+static int binop(Inst f, int *k) /* R_ op for a binary operator, *k: constant operand form */
+{
+  int i;
+
+  for (i = 0; binops[i].op; i++) {
+    if (f == binops[i].op || f == binops[i].op_k) {
+      *k = f == binops[i].op_k;
+      return binops[i].rop;
+    }
+  }
+  return -1;
+}
+
+static Inst *gen(RegCode *rc, Inst *p, Inst *end) /* translate p up to end or STOP */
+{
+  static const char *undefmsg[] = {
+    "cannot use += on undefined variable", "cannot use -= on undefined variable",
+    "cannot use *= on undefined variable", "cannot use /= on undefined variable",
+    "cannot use ++ on undefined variable", "cannot use -- on undefined variable"
+  };
+  Inst f;
+  Symbol *sp;
+  Datum *a, *b, *d;
+  RegOp *o;
+  int k, op, at, skip;
+
+  while (p != end && (f = *p) != STOP) {
+    if (f == constpush) {
+      push1(rc, &((Symbol *)p[1])->u.v, 0, 0);
+    } else if (f == varpush) {
+      push1(rc, 0, 0, (Symbol *)p[1]);
+    } else if (f == eval) {
+      sp = popsym(rc);
+      check(rc, sp, "undefined variable"); /* 導出変数などはスタックマシンで */
+      push1(rc, &sp->u.v, sp, 0);
+    } else if (f == tmpval) {
+      sp = (Symbol *)p[1];
+      push1(rc, &sp->u.v, sp, 0);
+    } else if ((op = binop(f, &k)) >= 0) {
+      b = k ? &((Symbol *)p[1])->u.v : popval(rc);
+      a = popval(rc);
+      d = temp(rc);
+      emit(rc, op, d, a, b);
+      push1(rc, d, 0, 0);
+    } else if (f == negate || f == not || f == truth || f == bltin) {
+      a = popval(rc);
+      d = temp(rc);
+      o = emit(rc, f == negate ? R_NEG : f == not ? R_NOT : f == truth ? R_TRUTH : R_BLTIN, d, a, 0);
+      if (f == bltin) {
+        o->f = (double (*)())p[1];
+      }
+      push1(rc, d, 0, 0);
+    } else if (f == power) {
+      b = popval(rc);
+      a = popval(rc);
+      d = temp(rc);
+      emit(rc, R_POW, d, a, b);
+      push1(rc, d, 0, 0);
+    } else if (f == assign) {
+      sp = popsym(rc);
+      a = popval(rc);
+      if (sp->type != VAR && sp->type != UNDEF) {
+        longjmp(rc->fail, 1);
+      }
+      store(rc, sp, R_MOVE, a, 0);
+    } else if (f == argstore) {
+      a = popval(rc);
+      store(rc, (Symbol *)p[1], R_MOVE, a, 0);
+      rc->sp--;
+    } else if (f == addeq || f == subeq || f == muleq || f == diveq) {
+      sp = popsym(rc);
+      b = popval(rc);
+      k = f == addeq ? 0 : f == subeq ? 1 : f == muleq ? 2 : 3;
+      check(rc, sp, undefmsg[k]);
+      store(rc, sp, k == 0 ? R_add : k == 1 ? R_sub : k == 2 ? R_mul : R_divide, &sp->u.v, b);
+    } else if (f == pre_increment || f == post_increment || f == pre_decrement || f == post_decrement) {
+      sp = popsym(rc);
+      k = f == pre_increment || f == post_increment;
+      check(rc, sp, undefmsg[k ? 4 : 5]);
+      if ((f == post_increment || f == post_decrement) && p[1] != popstack) {
+        d = temp(rc); /* 古い値 */
+        spill(rc, sp);
+        emit(rc, R_MOVE, d, &sp->u.v, 0);
+        store(rc, sp, k ? R_add : R_sub, &sp->u.v, &rc->one);
+        rc->stack[rc->sp - 1].v = d;
+        rc->stack[rc->sp - 1].var = 0;
+      } else {
+        store(rc, sp, k ? R_add : R_sub, &sp->u.v, &rc->one);
+      }
+    } else if (f == print || f == prexpr) {
+      emit(rc, f == print ? R_PRINT : R_PREXPR, 0, popval(rc), 0);
+    } else if (f == popstack) {
+      pop1(rc);
+    } else if (f == duptop) {
+      Item it = pop1(rc);
+      push1(rc, it.v, it.var, it.sym);
+      push1(rc, it.v, it.var, it.sym);
+    } else if (f == andcode || f == orcode) {
+      spill(rc, 0);
+      a = popval(rc);
+      at = rc->nop;
+      emit(rc, f == andcode ? R_AND : R_OR, temp(rc), a, 0);
+      gen(rc, p + 2, (Inst *)p[1]); /* 右のオペランドとtruth */
+      rc->op[at].to = label(rc);
+      p = (Inst *)p[1];
+      continue;
+    } else if (f == ifcode) {
+      spill(rc, 0);
+      gen(rc, p + 4, 0);
+      at = rc->nop;
+      emit(rc, R_FALSE, 0, popval(rc), 0);
+      gen(rc, (Inst *)p[1], 0);
+      if (p[2]) {
+        skip = rc->nop;
+        emit(rc, R_JUMP, 0, 0, 0);
+        rc->op[at].to = label(rc);
+        gen(rc, (Inst *)p[2], 0);
+        rc->op[skip].to = label(rc);
+      } else {
+        rc->op[at].to = label(rc);
+      }
+      p = (Inst *)p[3];
+      continue;
+    } else if (f == whilecode) {
+      spill(rc, 0);
+      k = label(rc);
+      gen(rc, p + 3, 0);
+      at = rc->nop;
+      emit(rc, R_FALSE, 0, popval(rc), 0);
+      gen(rc, (Inst *)p[1], 0);
+      emit(rc, R_JUMP, 0, 0, 0)->to = k;
+      rc->op[at].to = label(rc);
+      p = (Inst *)p[2];
+      continue;
+    } else if (f == forcode) {
+      spill(rc, 0);
+      k = label(rc);
+      gen(rc, p + 4, 0);
+      at = rc->nop;
+      emit(rc, R_FALSE, 0, popval(rc), 0);
+      gen(rc, (Inst *)p[1], 0);
+      gen(rc, (Inst *)p[3], 0); /* step */
+      emit(rc, R_JUMP, 0, 0, 0)->to = k;
+      rc->op[at].to = label(rc);
+      p = (Inst *)p[2];
+      continue;
+    } else if (f == forloop) {
+      /* FORTESTで最初の条件を調べ、FORNEXTが増やして比べて本体の先頭へ戻る */
+      spill(rc, 0);
+      at = rc->nop;
+      forop(rc, R_FORTEST, p);
+      k = label(rc);
+      gen(rc, (Inst *)p[1], 0);
+      forop(rc, R_FORNEXT, p)->to = k;
+      rc->op[at].to = label(rc);
+      p = (Inst *)p[2];
+      continue;
+    } else if (f == invreset) {
+      emit(rc, R_INVRESET, 0, 0, 0)->sym = (Symbol *)p[1];
+    } else if (f == invar) {
+      /* 覚えた値があればr[sp]に入れて式を飛ばす 式の値はinvstoreがr[sp]に置く */
+      at = rc->nop;
+      emit(rc, R_INVAR, temp(rc), 0, 0)->sym = (Symbol *)p[1];
+      gen(rc, p + 3, (Inst *)p[2]);
+      rc->op[at].to = label(rc);
+      p = (Inst *)p[2];
+      continue;
+    } else if (f == invstore) {
+      a = popval(rc);
+      d = temp(rc);
+      if (a != d) {
+        emit(rc, R_MOVE, d, a, 0);
+      }
+      emit(rc, R_INVSTORE, 0, d, 0)->sym = (Symbol *)p[1];
+      push1(rc, d, 0, 0);
+    } else if (f == call) {
+      sp = (Symbol *)p[1];
+      spill(rc, 0); /* 関数はどの変数も書き換えうる */
+      stack(rc, p, (int)(long)p[2], sp->type == FUNCTION);
+    } else if (f == fieldpush || f == loadcode) {
+      stack(rc, p, 0, 1);
+    } else if (f == arrpush || f == arrstore) {
+      stack(rc, p, f == arrpush ? 1 : 2, 1);
+    } else if (f == mapcode) {
+      stack(rc, p, 0, 1);
+    } else if (f == varread) {
+      spill(rc, (Symbol *)p[1]);
+      stack(rc, p, 0, 1);
+    } else if (f == savecode || f == restorecode) {
+      spill(rc, 0);
+      stack(rc, p, 0, 0);
+    } else { /* parallel for, 関数の中だけの命令など */
+      longjmp(rc->fail, 1);
+    }
+    p += inst_len(p);
+  }
+  return p;
+}
+
+static void trace(RegCode *rc, RegOp *o)
+{
+  fprintf(stderr, "[r%04ld] %-12s", (long)(o - rc->op), opname[o->op]);
+  if (o->store) {
+    fprintf(stderr, " sym='%s'", o->store->name);
+  } else if (o->sym) {
+    fprintf(stderr, " sym='%s'", o->sym->name);
+  }
+  if (o->op == R_JUMP || o->op == R_FALSE || o->op == R_AND || o->op == R_OR || o->op == R_INVAR ||
+      o->op == R_FORTEST || o->op == R_FORNEXT) {
+    fprintf(stderr, " -> %d", o->to);
+  }
+  fprintf(stderr, "\n");
+}
+
+static void run(HocVM *vm, RegCode *rc)
+{
+  RegOp *op = rc->op, *o;
+  Datum a, b;
+  int i, j, n = rc->nop;
+
+  for (i = 0; i < n; ) {
+    o = &op[i++];
+    if (--vm->steps < 0) { /* 命令数と時間の予算 */
+      vm_tick(vm);
+    }
+    if (vm->trace) {
+      trace(rc, o);
+    }
+    rc->nrun++;
+    switch (o->op) {
+#define REG_CASE(name, expr, swapped) \
+      case R_##name: \
+        a = *o->a; \
+        b = *o->b; \
+        *o->d = expr; \
+        break;
+      BINOPS(REG_CASE)
+      case R_MOVE:
+        *o->d = *o->a;
+        break;
+      case R_NEG:
+        *o->d = negv(*o->a);
+        break;
+      case R_POW:
+        *o->d = powv(*o->a, *o->b);
+        break;
+      case R_NOT:
+        *o->d = mkbool(!istrue(*o->a));
+        break;
+      case R_TRUTH:
+        *o->d = mkbool(istrue(*o->a));
+        break;
+      case R_BLTIN:
+        *o->d = bltinv(o->f, *o->a);
+        break;
+      case R_CHECK:
+        if (o->sym->type != VAR) {
+          execerror(o->msg, o->sym->name);
+        }
+        continue;
+      case R_JUMP:
+        i = o->to;
+        continue;
+      case R_FALSE:
+        if (!istrue(*o->a)) {
+          i = o->to;
+        }
+        continue;
+      case R_AND:
+      case R_OR:
+        if (istrue(*o->a) == (o->op == R_OR)) { /* 右は計算しない */
+          *o->d = mkbool(o->op == R_OR);
+          i = o->to;
+        }
+        continue;
+      case R_INVRESET:
+        o->sym->type = UNDEF;
+        continue;
+      case R_INVAR:
+        if (o->sym->type == VAR) {
+          *o->d = o->sym->u.v;
+          i = o->to;
+        }
+        continue;
+      case R_INVSTORE:
+        o->sym->u.v = *o->a;
+        o->sym->type = VAR;
+        continue;
+      case R_PRINT:
+        fprintf(vm->fout, "\t%.8g\n", num(*o->a));
+        continue;
+      case R_PREXPR:
+        fprintf(vm->fout, "%.8g\n", num(*o->a));
+        continue;
+      case R_STACK:
+        for (j = 0; j < o->nargs; j++) {
+          push(*rc->argv[o->args + j]);
+        }
+        execute(o->code);
+        if (o->nres) {
+          *o->d = pop();
+        }
+        continue;
+      case R_FORTEST:
+        if (!fortest(o->sym, o->lim, o->cmp)) {
+          i = o->to;
+        }
+        continue;
+      case R_FORNEXT: /* 増やして比べて戻る */
+        fornext(o->sym, o->inc, o->down);
+        if (fortest(o->sym, o->lim, o->cmp)) {
+          i = o->to;
+        }
+        continue;
+    }
+    if (o->store) { /* 変数に書いた */
+      o->store->type = VAR;
+      changed(o->store);
+    }
+  }
+}
+
+int reg_run(HocVM *vm, Inst *p) /* run the statement at p as register code, 0 if it can't be */
+{
+  RegCode *rc = vm->rcode;
+
+  if (rc == 0) {
+    if ((rc = vm->rcode = (RegCode *)calloc(1, sizeof(RegCode))) == 0) {
+      return 0;
+    }
+    rc->one = mkint(1);
+  }
+  rc->nop = rc->mark = rc->nargv = rc->sp = 0;
+  if (setjmp(rc->fail)) {
+    rc->nfallback++;
+    return 0;
+  }
+  gen(rc, p, 0);
+  rc->nlowered++;
+  run(vm, rc);
+  return 1;
+}
+
+void reg_free(HocVM *vm)
+{
+  RegCode *rc = vm->rcode;
+
+  if (rc) {
+    free(rc->op);
+    free(rc->argv);
+    free(rc);
+    vm->rcode = 0;
+  }
+}
+
+void reg_stats(HocVM *vm, FILE *fp)
+{
+  RegCode *rc = vm->rcode;
+
+  if (rc) {
+    fprintf(fp, "register: %ld statements, %ld run on the stack machine, %ld ops\n",
+        rc->nlowered, rc->nfallback, rc->nrun);
+  }
+}
@@ -0,0 +1,94 @@
+#include "hoc.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 協調スケジューラ  hoc5 -m [-q quota] prog...
+ *
+ * 1つのスレッドで多くのプログラムを少しずつ順番に実行する。
+ * プログラムごとにVMを作り、vm_resumeでおよそquota命令ずつ実行しては
+ * 次のプログラムに回す (ラウンドロビン)。ループの1周ごとに区切れるので、
+ * 終わらないループがあっても他のプログラムにはquota命令ごとに順番が来る。
+ * 出力はどれも標準出力に出る (行の途中で混ざることはない)。
+ * ソースは最初に全部メモリに読むので、ファイル記述子はプログラムの数だけ要らない。
+ */
+
+typedef struct Task {
+  HocVM *vm;
+  char *src;
+  long slices;       /* vm_resumeを呼んだ回数 */
+} Task;
+
+static char *slurp(const char *file) /* contents of file as a string */
+{
+  FILE *fp = fopen(file, "r");
+  size_t len = 0, size = 4096;
+  char *buf = malloc(size), *p;
+
+  if (fp == 0 || buf == 0) {
+    if (fp) {
+      fclose(fp);
+    }
+    free(buf);
+    return 0;
+  }
+  while ((len += fread(buf + len, 1, size - len - 1, fp)) == size - 1) {
+    if ((p = realloc(buf, size *= 2)) == 0) {
+      break;
+    }
+    buf = p;
+  }
+  buf[len] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+int hocsched(char **files, int nfiles, long quota, int stats) /* run the programs together, return errors */
+{
+  Task *task = (Task *)calloc(nfiles + 1, sizeof(Task));
+  long slices = 0, maxslices = 0;
+  int i, n = 0, live, nerrors = 0;
+
+  if (task == 0) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  for (i = 0; i < nfiles; i++) {
+    if ((task[n].src = slurp(files[i])) == 0 || (task[n].vm = vm_create()) == 0) {
+      fprintf(stderr, "can't open %s\n", files[i]);
+      free(task[n].src);
+      nerrors++;
+      continue;
+    }
+    task[n].vm->name = files[i];
+    task[n].vm->trace = 0;
+    vm_load_string(task[n].vm, task[n].src);
+    n++;
+  }
+  for (live = n; live > 0; ) {
+    for (i = 0; i < n; i++) {
+      if (task[i].vm == 0) {
+        continue;
+      }
+      task[i].slices++;
+      if (vm_resume(task[i].vm, quota) == 0) { /* 終わった */
+        if (stats) {
+          vm_stats(task[i].vm, stderr);
+        }
+        nerrors += task[i].vm->nerrors;
+        slices += task[i].slices;
+        maxslices = task[i].slices > maxslices ? task[i].slices : maxslices;
+        vm_free(task[i].vm);
+        free(task[i].src);
+        task[i].vm = 0;
+        live--;
+      }
+    }
+  }
+  if (stats) {
+    fprintf(stderr, "scheduler: %d programs, %ld slices of %ld instructions, longest %ld slices\n",
+        n, slices, quota, maxslices);
+  }
+  free(task);
+  return nerrors;
+}
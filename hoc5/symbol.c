@@ -1,39 +1,84 @@
 #include "hoc.h"
 #include "y.tab.h"
+#include <stdlib.h>
 #include <string.h>
 
-static Symbol *symlist = 0; /* symbol table: linked list */
+/* 組み込み関数・定数・キーワード init()で作り、以後は読み取り専用 */
+static Symbol *shared = 0;
+static Arena sharedarena = { .blocksize = 4096 };
 
-Symbol *lookup(char *s) /* find s in symbol table */
+static Symbol *search(Symbol *sp, char *s)
 {
-  Symbol *sp;
-
-  for (sp = symlist; sp != (Symbol *)0; sp = sp->next) {
+  for (; sp != (Symbol *)0; sp = sp->next) {
     if (strcmp(sp->name, s) == 0) {
       return sp;
     }
   }
-  return 0; /* 0 ===> not found */
+  return 0;
+}
+
+Symbol *lookup(char *s) /* find s in symbol table */
+{
+  Symbol *sp;
+
+  double d;
+
+  if (curvm && (sp = search(curvm->symlist, s)) != 0) {
+    return sp;
+  }
+  if (curvm && image_lookup(curvm, s, &d)) { /* restoreした変数は最初の参照で登録 */
+    return install(s, VAR, d);
+  }
+  sp = search(shared, s);
+  if (sp && sp->type == VAR && curvm) {
+    /* 定数は代入できるので、共有表を書き換えないようVMごとに複製する */
+    sp = install(sp->name, VAR, num(sp->u.v));
+  }
+  return sp; /* 0 ===> not found */
 }
 
 Symbol *install(char *s, int t, double d) /* install s in symbol table */
 {
   Symbol *sp;
-  char *emalloc();
+  Symbol **list = curvm ? &curvm->symlist : &shared;
+  Arena *a = curvm ? &curvm->symarena : &sharedarena;
 
-  sp = (Symbol *)emalloc(sizeof(Symbol));
-  sp->name = emalloc(strlen(s) + 1); /* +1 for '\0' */
+  sp = (Symbol *)arena_alloc(a, sizeof(Symbol));
+  sp->name = arena_alloc(a, strlen(s) + 1); /* +1 for '\0' */
   strcpy(sp->name, s);
   sp->type = t;
-  sp->u.val = d;
-  sp->next = symlist; /* put at front of list */
-  symlist = sp;
+  sp->u.v = mkvalue(d);
+  sp->users = 0;
+  sp->next = *list; /* put at front of list */
+  *list = sp;
+  return sp;
+}
+
+void *ctalloc(size_t n) /* compile-time data: per statement, or kept while defining a function */
+{
+  HocVM *vm = curvm;
+
+  if (vm->indef || vm->persist) {
+    return arena_alloc(&vm->symarena, n);
+  }
+  return arena_alloc(vm->keep ? vm->keep : &vm->stmtarena, n);
+}
+
+Symbol *constsym(double d) /* numeric constant, lives until next initcode() */
+{
+  Symbol *sp = (Symbol *)ctalloc(sizeof(Symbol));
+
+  sp->name = "";
+  sp->type = NUMBER;
+  sp->u.v = mkvalue(d); /* 整数の定数は整数で持つ */
+  sp->users = 0;
+  sp->next = 0; /* 変数表にはつながない */
   return sp;
 }
 
 char *emalloc(unsigned n) /* check return from malloc */
 {
-  char *p, *malloc();
+  char *p;
 
   p = malloc(n);
 
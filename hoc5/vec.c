@@ -0,0 +1,574 @@
+#include "hoc.h"
+#include "y.tab.h"
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * 列ごとの実行  hoc5 -V -f prog data...
+ *
+ * レコードをNVEC行ずつまとめ、1つの命令でNVEC行分の値 (列) を計算する。
+ * 翻訳済みのスタックマシンのコードを最初に一度たどり、列を単位にした
+ * 3番地の命令 (VecOp) に直しておく。命令の中身はdoubleの配列のループだけになる。
+ * レジスタ (列) は一度しか書かないので、printは全部計算してから行の順に出す。
+ * if と && || は条件の列からマスクを作って両方の側を計算し、
+ * マスクの下の代入は新しい値と古い値をマスクで選ぶ。
+ *
+ * 変数は、その行で代入してから読むものと、プログラムで代入しないもの
+ * (どの行でも同じ値) だけを扱う。前の行の値を読む変数や、while・関数呼び出し・
+ * read() などがあるプログラムは直さず、今までどおり1行ずつ実行する。
+ * 0での割り算や数学関数のエラー (errno) があったまとまりは、変数を書き戻さず
+ * 1行ずつ実行し直すので、結果やエラーメッセージは1行ずつのときと変わらない。
+ */
+
+#define NVEC 1024 /* rows per block */
+
+extern double Log(), Log10(), Exp(), Sqrt();
+
+#define VEC_ENUM(name, expr, swapped) V_##name,
+enum {
+  BINOPS(VEC_ENUM)
+  V_NEG, V_NOT, V_POW, V_FUNC, V_INT, V_AND, V_OR, V_TRUTH, V_MASK, V_SELECT, V_PRINT, V_PREXPR
+};
+
+typedef struct VecOp {
+  int op;
+  int d, a, b;        /* registers, V_MASKのbは条件を反転するか */
+  int m;              /* mask register, -1: every row */
+  double (*f)(double);
+} VecOp;
+
+enum { R_TEMP, R_CONST, R_UNIFORM, R_FIELD };
+
+typedef struct Reg {
+  int kind;
+  double k;           /* R_CONST */
+  Symbol *sym;        /* R_UNIFORM */
+  int field;          /* R_FIELD */
+} Reg;
+
+typedef struct Var {
+  Symbol *sym;
+  int reg;            /* 今の値 */
+} Var;
+
+typedef struct Item {  /* 翻訳中のスタック */
+  int reg;
+  Symbol *sym;        /* varpushした変数 */
+} Item;
+
+typedef struct Vec {
+  VecOp *op;
+  int nop, maxop;
+  Reg *reg;
+  int nreg, maxreg;
+  Var *var;           /* 行の中で代入した変数 */
+  int nvar, maxvar;
+  Symbol **written;   /* プログラムのどこかで代入する変数 */
+  int nwritten, maxwritten;
+  Item stack[NSTACK];
+  int sp;
+  int nfield;         /* largest $n used */
+  jmp_buf fail;
+  double *mem;        /* NVEC doubles per register */
+  double **val;       /* 実行中の各レジスタの列 */
+  double **fcol, **fbuf; /* フィールドの列 vm_blockに渡す */
+  long blocks, fallbacks;
+} Vec;
+
+static struct {
+  double (*hoc)();
+  double (*f)(double);
+} funcs[] = {
+  { (double (*)())sin, sin }, { (double (*)())cos, cos }, { (double (*)())atan, atan },
+  { (double (*)())fabs, fabs }, { Log, log }, { Log10, log10 }, { Exp, exp }, { Sqrt, sqrt },
+  { 0, 0 } /* rand()などは列にしない */
+};
+
+#define VEC_BINOP(name, expr, swapped) { name, name##_k, V_##name },
+static struct {
+  Inst op, op_k;
+  int vop;
+} binops[] = {
+  BINOPS(VEC_BINOP)
+  { 0, 0, 0 }
+};
+
+static void *grow(Vec *v, void *p, int *max, int n, size_t size)
+{
+  if (n >= *max) {
+    *max = *max ? 2 * *max : 16;
+    if ((p = realloc(p, *max * size)) == 0) {
+      longjmp(v->fail, 1);
+    }
+  }
+  return p;
+}
+
+static int newreg(Vec *v, int kind)
+{
+  v->reg = grow(v, v->reg, &v->maxreg, v->nreg, sizeof(Reg));
+  v->reg[v->nreg].kind = kind;
+  v->reg[v->nreg].sym = 0;
+  return v->nreg++;
+}
+
+static int constreg(Vec *v, double k)
+{
+  int i;
+
+  for (i = 0; i < v->nreg; i++) {
+    if (v->reg[i].kind == R_CONST && memcmp(&v->reg[i].k, &k, sizeof(k)) == 0) {
+      return i;
+    }
+  }
+  i = newreg(v, R_CONST);
+  v->reg[i].k = k;
+  return i;
+}
+
+static int uniformreg(Vec *v, Symbol *sp)
+{
+  int i;
+
+  for (i = 0; i < v->nreg; i++) {
+    if (v->reg[i].kind == R_UNIFORM && v->reg[i].sym == sp) {
+      return i;
+    }
+  }
+  i = newreg(v, R_UNIFORM);
+  v->reg[i].sym = sp;
+  return i;
+}
+
+static int fieldreg(Vec *v, int n)
+{
+  int i;
+
+  if (n < 1 || n > NFIELD) { /* 無いフィールドは0 */
+    return constreg(v, 0.0);
+  }
+  for (i = 0; i < v->nreg; i++) {
+    if (v->reg[i].kind == R_FIELD && v->reg[i].field == n) {
+      return i;
+    }
+  }
+  i = newreg(v, R_FIELD);
+  v->reg[i].field = n;
+  if (n > v->nfield) {
+    v->nfield = n;
+  }
+  return i;
+}
+
+static int emit(Vec *v, int op, int a, int b, int m) /* append an op, return its result register */
+{
+  VecOp *o;
+
+  v->op = grow(v, v->op, &v->maxop, v->nop, sizeof(VecOp));
+  o = &v->op[v->nop++];
+  o->op = op;
+  o->a = a;
+  o->b = b;
+  o->m = m;
+  o->f = 0;
+  o->d = (op == V_PRINT || op == V_PREXPR) ? -1 : newreg(v, R_TEMP);
+  return o->d;
+}
+
+static void vpush(Vec *v, int reg, Symbol *sp)
+{
+  if (v->sp >= NSTACK) {
+    longjmp(v->fail, 1);
+  }
+  v->stack[v->sp].reg = reg;
+  v->stack[v->sp++].sym = sp;
+}
+
+static int popreg(Vec *v)
+{
+  if (v->sp <= 0 || v->stack[v->sp-1].sym) {
+    longjmp(v->fail, 1);
+  }
+  return v->stack[--v->sp].reg;
+}
+
+static Symbol *popsym(Vec *v)
+{
+  if (v->sp <= 0 || v->stack[v->sp-1].sym == 0) {
+    longjmp(v->fail, 1);
+  }
+  return v->stack[--v->sp].sym;
+}
+
+static Var *findvar(Vec *v, Symbol *sp)
+{
+  int i;
+
+  for (i = 0; i < v->nvar; i++) {
+    if (v->var[i].sym == sp) {
+      return &v->var[i];
+    }
+  }
+  return 0;
+}
+
+static int readvar(Vec *v, Symbol *sp)
+{
+  Var *x = findvar(v, sp);
+  int i;
+
+  if (x) {
+    return x->reg;
+  }
+  for (i = 0; i < v->nwritten; i++) {
+    if (v->written[i] == sp) {
+      longjmp(v->fail, 1); /* 前の行の値を読む */
+    }
+  }
+  if (sp->type != VAR) {
+    longjmp(v->fail, 1);
+  }
+  return uniformreg(v, sp);
+}
+
+static void store(Vec *v, Symbol *sp, int reg, int m)
+{
+  Var *x = findvar(v, sp);
+
+  if (sp->type != VAR && sp->type != UNDEF) {
+    longjmp(v->fail, 1);
+  }
+  if (m >= 0) { /* 条件の成り立たない行は古い値のまま */
+    if (x == 0) {
+      longjmp(v->fail, 1);
+    }
+    x->reg = emit(v, V_SELECT, reg, x->reg, m);
+    return;
+  }
+  if (x == 0) {
+    v->var = grow(v, v->var, &v->maxvar, v->nvar, sizeof(Var));
+    x = &v->var[v->nvar++];
+    x->sym = sp;
+  }
+  x->reg = reg;
+}
+
+static int isstore(Inst f)
+{
+  return f == assign || f == addeq || f == subeq || f == muleq || f == diveq ||
+      f == pre_increment || f == post_increment || f == pre_decrement || f == post_decrement ||
+      f == varread;
+}
+
+static int binop(Inst f, int *k) /* V_ op for a binary operator, *k: constant operand form */
+{
+  int i;
+
+  for (i = 0; binops[i].op; i++) {
+    if (f == binops[i].op || f == binops[i].op_k) {
+      *k = f == binops[i].op_k;
+      return binops[i].vop;
+    }
+  }
+  return -1;
+}
+
+static Inst *gen(Vec *v, Inst *p, Inst *end, int m) /* translate p up to end or STOP under mask m */
+{
+  Inst f;
+  Symbol *sp;
+  int a, b, c, k, op;
+
+  while (p != end && (f = *p) != STOP) {
+    if (f == constpush) {
+      vpush(v, constreg(v, num(((Symbol *)p[1])->u.v)), 0);
+    } else if (f == varpush) {
+      vpush(v, 0, (Symbol *)p[1]);
+    } else if (f == eval) {
+      vpush(v, readvar(v, popsym(v)), 0);
+    } else if (f == tmpval) {
+      vpush(v, readvar(v, (Symbol *)p[1]), 0);
+    } else if (f == fieldpush) {
+      vpush(v, fieldreg(v, (int)(long)p[1]), 0);
+    } else if ((op = binop(f, &k)) >= 0) {
+      b = k ? constreg(v, num(((Symbol *)p[1])->u.v)) : popreg(v);
+      a = popreg(v);
+      vpush(v, emit(v, op, a, b, m), 0);
+    } else if (f == assign || f == argstore) {
+      sp = f == assign ? popsym(v) : (Symbol *)p[1];
+      a = popreg(v);
+      store(v, sp, a, m);
+      if (f == assign) {
+        vpush(v, a, 0);
+      }
+    } else if (f == addeq || f == subeq || f == muleq || f == diveq) {
+      sp = popsym(v);
+      b = popreg(v);
+      op = f == addeq ? V_add : f == subeq ? V_sub : f == muleq ? V_mul : V_divide;
+      if (sp->type != VAR) {
+        longjmp(v->fail, 1);
+      }
+      c = emit(v, op, readvar(v, sp), b, m);
+      store(v, sp, c, m);
+      vpush(v, c, 0);
+    } else if (f == pre_increment || f == post_increment || f == pre_decrement || f == post_decrement) {
+      sp = popsym(v);
+      if (sp->type != VAR) {
+        longjmp(v->fail, 1);
+      }
+      a = readvar(v, sp);
+      op = (f == pre_increment || f == post_increment) ? V_add : V_sub;
+      c = emit(v, op, a, constreg(v, 1.0), m);
+      store(v, sp, c, m);
+      vpush(v, (f == pre_increment || f == pre_decrement) ? c : a, 0);
+    } else if (f == negate || f == not || f == truth) {
+      a = popreg(v);
+      vpush(v, emit(v, f == negate ? V_NEG : f == not ? V_NOT : V_TRUTH, a, 0, m), 0);
+    } else if (f == power) {
+      b = popreg(v);
+      a = popreg(v);
+      vpush(v, emit(v, V_POW, a, b, m), 0);
+    } else if (f == bltin) {
+      a = popreg(v);
+      if ((double (*)())p[1] == integer) {
+        vpush(v, emit(v, V_INT, a, 0, m), 0);
+      } else {
+        for (k = 0; funcs[k].hoc && funcs[k].hoc != (double (*)())p[1]; k++) {
+        }
+        if (funcs[k].hoc == 0) {
+          longjmp(v->fail, 1);
+        }
+        c = emit(v, V_FUNC, a, 0, m);
+        v->op[v->nop-1].f = funcs[k].f;
+        vpush(v, c, 0);
+      }
+    } else if (f == print || f == prexpr) {
+      emit(v, f == print ? V_PRINT : V_PREXPR, popreg(v), 0, m);
+    } else if (f == popstack) {
+      if (--v->sp < 0) {
+        longjmp(v->fail, 1);
+      }
+    } else if (f == duptop) {
+      a = popreg(v);
+      vpush(v, a, 0);
+      vpush(v, a, 0);
+    } else if (f == andcode || f == orcode) {
+      /* 右のオペランドは左で決まらない行だけをマスクにして計算する */
+      a = popreg(v);
+      c = emit(v, V_MASK, a, f == orcode, m);
+      gen(v, p + 2, (Inst *)p[1], c);
+      b = popreg(v);
+      vpush(v, emit(v, f == andcode ? V_AND : V_OR, a, b, m), 0);
+      p = (Inst *)p[1];
+      continue;
+    } else if (f == ifcode) {
+      gen(v, p + 4, 0, m);
+      c = popreg(v);
+      gen(v, (Inst *)p[1], 0, emit(v, V_MASK, c, 0, m));
+      if (p[2]) {
+        gen(v, (Inst *)p[2], 0, emit(v, V_MASK, c, 1, m));
+      }
+      p = (Inst *)p[3];
+      continue;
+    } else { /* while, 関数呼び出し, read() など */
+      longjmp(v->fail, 1);
+    }
+    p += inst_len(p);
+  }
+  return p;
+}
+
+static void vec_release(Vec *v)
+{
+  free(v->op);
+  free(v->reg);
+  free(v->var);
+  free(v->written);
+  free(v->mem);
+  free(v->val);
+  free(v->fcol);
+  free(v->fbuf);
+  free(v);
+}
+
+Vec *vec_compile(HocVM *vm) /* translate the compiled program, 0 if it must run row by row */
+{
+  Vec *volatile v = (Vec *)calloc(1, sizeof(Vec)); /* setjmpのあとも使う */
+  Inst *p;
+  int i, j;
+
+  if (v == 0) {
+    return 0;
+  }
+  if (setjmp(v->fail)) {
+    vec_release(v);
+    return 0;
+  }
+  for (p = vm->prog; p < vm->progp; p += inst_len(p)) {
+    if ((*p == varpush && p + 2 < vm->progp && isstore(p[2])) || *p == argstore) {
+      v->written = grow(v, v->written, &v->maxwritten, v->nwritten, sizeof(Symbol *));
+      v->written[v->nwritten++] = (Symbol *)p[1];
+    }
+  }
+  for (p = vm->prog; p < vm->progp; p++) { /* 文はSTOPで終わる */
+    v->sp = 0;
+    p = gen(v, p, 0, -1);
+  }
+
+  v->mem = (double *)malloc((size_t)v->nreg * NVEC * sizeof(double));
+  v->val = (double **)malloc((v->nreg + 1) * sizeof(double *));
+  v->fcol = (double **)calloc(v->nfield + 1, sizeof(double *));
+  v->fbuf = (double **)calloc(v->nfield + 1, sizeof(double *));
+  if (v->mem == 0 || v->val == 0 || v->fcol == 0 || v->fbuf == 0) {
+    longjmp(v->fail, 1);
+  }
+  for (i = 0; i < v->nreg; i++) {
+    v->val[i] = v->mem + (size_t)i * NVEC;
+    if (v->reg[i].kind == R_CONST) {
+      for (j = 0; j < NVEC; j++) {
+        v->val[i][j] = v->reg[i].k;
+      }
+    } else if (v->reg[i].kind == R_FIELD) {
+      v->fbuf[v->reg[i].field - 1] = v->val[i];
+    }
+  }
+  return v;
+}
+
+void vec_free(HocVM *vm)
+{
+  if (vm->vec) {
+    vec_release(vm->vec);
+    vm->vec = 0;
+  }
+}
+
+static int execops(Vec *v, long n) /* run the ops on n rows, 0 if a row has an error */
+{
+  VecOp *o;
+  double *d, *a, *b, *m;
+  long i;
+
+  for (o = v->op; o < v->op + v->nop; o++) {
+    d = o->d >= 0 ? v->val[o->d] : 0;
+    a = v->val[o->a];
+    b = o->op != V_MASK ? v->val[o->b] : 0;
+    m = o->m >= 0 ? v->val[o->m] : 0;
+    switch (o->op) {
+#define LOOP(e) for (i = 0; i < n; i++) { d[i] = (e); } break
+      case V_add: LOOP(a[i] + b[i]);
+      case V_sub: LOOP(a[i] - b[i]);
+      case V_mul: LOOP(a[i] * b[i]);
+      case V_divide:
+        for (i = 0; i < n; i++) {
+          if (b[i] == 0.0 && (m == 0 || m[i] != 0.0)) {
+            return 0; /* division by zero */
+          }
+        }
+        LOOP(a[i] / b[i]);
+      case V_gt: LOOP(a[i] > b[i]);
+      case V_lt: LOOP(a[i] < b[i]);
+      case V_ge: LOOP(a[i] >= b[i]);
+      case V_le: LOOP(a[i] <= b[i]);
+      case V_eq: LOOP(a[i] == b[i]);
+      case V_ne: LOOP(a[i] != b[i]);
+      case V_NEG: LOOP(-a[i]);
+      case V_NOT: LOOP(a[i] == 0.0);
+      case V_TRUTH: LOOP(a[i] != 0.0);
+      case V_AND: LOOP(a[i] != 0.0 && b[i] != 0.0);
+      case V_OR: LOOP(a[i] != 0.0 || b[i] != 0.0);
+      case V_INT: LOOP(trunc(a[i]) + 0.0);
+      case V_SELECT: LOOP(m[i] != 0.0 ? a[i] : b[i]);
+      case V_MASK:
+        if (m) {
+          LOOP(m[i] != 0.0 && (a[i] != 0.0) != o->b);
+        }
+        LOOP((a[i] != 0.0) != o->b);
+      /* errnoを立てうるものはマスクの外で計算しない */
+      case V_POW: LOOP(m == 0 || m[i] != 0.0 ? pow(a[i], b[i]) : 0.0);
+      case V_FUNC: LOOP(m == 0 || m[i] != 0.0 ? (*o->f)(a[i]) : 0.0);
+      case V_PRINT:
+      case V_PREXPR:
+        break;
+#undef LOOP
+    }
+  }
+  return 1;
+}
+
+static void finish(Vec *v, HocVM *vm, long n) /* print in row order, store the last row's values */
+{
+  VecOp *o;
+  Var *x;
+  long i;
+
+  for (i = 0; i < n; i++) {
+    for (o = v->op; o < v->op + v->nop; o++) {
+      if ((o->op == V_PRINT || o->op == V_PREXPR) && (o->m < 0 || v->val[o->m][i] != 0.0)) {
+        fprintf(vm->fout, o->op == V_PRINT ? "\t%.8g\n" : "%.8g\n", v->val[o->a][i]);
+      }
+    }
+  }
+  for (x = v->var; x < v->var + v->nvar; x++) {
+    x->sym->type = VAR;
+    x->sym->u.v = mkvalue(v->val[x->reg][n-1]);
+    changed(x->sym);
+  }
+}
+
+void vec_run(HocVM *vm) /* run the translated program over the data, NVEC rows at a time */
+{
+  Vec *v = vm->vec;
+  char *dcur;
+  long n, row;
+  int i, e;
+
+  for (i = 0; i < v->nreg; i++) { /* プログラムで代入しない変数 */
+    if (v->reg[i].kind == R_UNIFORM) {
+      double x = num(v->reg[i].sym->u.v);
+      for (n = 0; n < NVEC; n++) {
+        v->val[i][n] = x;
+      }
+    }
+  }
+  for (;;) {
+    dcur = vm->dcur;
+    row = vm->row;
+    e = errno;
+    errno = 0;
+    n = vm_block(vm, v->fcol, v->fbuf, v->nfield, NVEC);
+    if (n == 0) {
+      errno = e;
+      break;
+    }
+    for (i = 0; i < v->nreg; i++) {
+      if (v->reg[i].kind == R_FIELD) {
+        v->val[i] = v->fcol[v->reg[i].field - 1];
+      }
+    }
+    if (e != 0 || !execops(v, n) || errno != 0) {
+      /* エラーになる行がある: このまとまりは1行ずつ実行し直す */
+      errno = e;
+      vm->dcur = dcur;
+      vm->row = row;
+      vm_records(vm, n);
+      v->fallbacks++;
+      continue;
+    }
+    errno = e;
+    finish(v, vm, n);
+    v->blocks++;
+  }
+}
+
+void vec_stats(HocVM *vm, FILE *fp)
+{
+  Vec *v = vm->vec;
+
+  if (v) {
+    fprintf(fp, "vector: %d ops, %d registers, %ld blocks, %ld run row by row\n",
+        v->nop, v->nreg, v->blocks, v->fallbacks);
+  }
+}
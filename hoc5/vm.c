@@ -0,0 +1,339 @@
+#include "hoc.h"
+#include <pthread.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+_Thread_local HocVM *curvm; /* 実行中のVM */
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+HocVM *vm_create(void) /* make a new interpreter */
+{
+  HocVM *vm;
+
+  pthread_once(&init_once, init); /* 共有表は最初の1回だけ作る */
+  vm = (HocVM *)calloc(1, sizeof(HocVM));
+  if (vm == 0) {
+    return 0;
+  }
+  vm->stackp = vm->stack;
+  vm->progp = vm->prog;
+  arena_init(&vm->symarena, 16384);
+  arena_init(&vm->stmtarena, 4096);
+  vm->lineno = 1;
+  vm->trace = 1;
+  vm->fin = stdin;
+  vm->fout = stdout;
+  vm->ferr = stderr;
+  vm->name = "hoc5";
+  vm_srand(vm, 1); /* libcのrandと同じく種1で始める */
+  vm_budget(vm, 0, 0);
+  return vm;
+}
+
+void vm_free(HocVM *vm)
+{
+  vm_data_free(vm);
+  array_free(vm);
+  image_free(vm);
+  derived_free(vm);
+  stmt_free(vm);
+  vec_free(vm);
+  reg_free(vm);
+  arena_free(&vm->symarena);
+  arena_free(&vm->stmtarena);
+  if (vm->fin && vm->fin != stdin) {
+    fclose(vm->fin);
+  }
+  free(vm);
+}
+
+void vm_load(HocVM *vm, FILE *fp) /* read program text from fp */
+{
+  if (vm->fin && vm->fin != stdin) {
+    fclose(vm->fin);
+  }
+  vm->fin = fp;
+  vm->lineno = 1;
+}
+
+int vm_load_string(HocVM *vm, const char *src) /* read program text from src */
+{
+  FILE *fp = fmemopen((void *)src, strlen(src), "r");
+
+  if (fp == 0) {
+    return -1;
+  }
+  vm_load(vm, fp);
+  return 0;
+}
+
+int vm_run(HocVM *vm) /* parse and execute until end of input */
+{
+  HocVM *saved = curvm;
+  Inst *p;
+  int n;
+
+  curvm = vm;
+  stmt_open(vm);
+  if (setjmp(vm->begin)) {
+    vm->nerrors++;
+  }
+  for (;;) {
+    initcode();
+    if ((p = stmt_lookup(vm)) == 0) { /* 前と同じ形の行なら翻訳しない */
+      n = vm->nerrors;
+      if (!yyparse()) {
+        break;
+      }
+      if (vm->nerrors > n) { /* 構文エラーの文は作りかけなので捨てる */
+        continue;
+      }
+      optimize(vm->prog);
+      stmt_remember(vm);
+      p = vm->prog;
+    }
+    if (!vm->regvm || !reg_run(vm, p)) {
+      execute(p);
+    }
+  }
+  stmt_close(vm);
+  curvm = saved;
+  return vm->nerrors;
+}
+
+int vm_resume(HocVM *vm, long quota) /* run about quota instructions, 0 at end of input */
+{
+  HocVM *saved = curvm;
+  int r, n;
+
+  curvm = vm;
+  vm->slice = quota;
+  if (setjmp(vm->begin)) {
+    vm->nerrors++;
+    vm->paused = 0; /* エラーになった文は捨てる */
+  }
+  for (;;) {
+    if (!vm->paused) {
+      if (vm->slice <= 0) { /* 文の間で順番を譲る */
+        r = 1;
+        break;
+      }
+      initcode();
+      n = vm->nerrors;
+      if (!yyparse()) {
+        r = 0;
+        break;
+      }
+      if (vm->nerrors > n) { /* 構文エラーの文は捨てる */
+        continue;
+      }
+      optimize(vm->prog);
+      vm->pc = vm->prog;
+      vm->nctl = 0;
+      vm->depth = 1;
+    }
+    if ((vm->paused = resume(vm)) != 0) {
+      r = 1;
+      break;
+    }
+  }
+  curvm = saved;
+  return r;
+}
+
+int vm_compile(HocVM *vm) /* parse the whole input without running it */
+{
+  HocVM *saved = curvm;
+  Inst *start;
+
+  int nerrors = vm->nerrors;
+
+  curvm = vm;
+  initcode();
+  if (setjmp(vm->begin) == 0) {
+    for (start = vm->prog; yyparse(); start = vm->progp) {
+      if (vm->nerrors > nerrors) { /* 構文エラーの文は作りかけなので捨てる */
+        vm->progp = start;
+        continue;
+      }
+      optimize(start); /* 文のコードをprogに続けて置いていく */
+    }
+  } else {
+    vm->nerrors++;
+  }
+  curvm = saved;
+  return vm->nerrors > nerrors ? -1 : 0;
+}
+
+int vm_parse(HocVM *vm) /* translate the next statement into prog: 1 if there is one, 0 at end, -1 on an error */
+{
+  HocVM *saved = curvm;
+  int nerrors = vm->nerrors;
+  volatile int r = -1;
+
+  curvm = vm;
+  if (setjmp(vm->begin) == 0) {
+    initcode();
+    if (!yyparse()) {
+      r = 0;
+    } else if (vm->nerrors == nerrors) { /* 構文エラーの文は作りかけ */
+      optimize(vm->prog);
+      r = 1;
+    }
+  } else {
+    vm->nerrors++;
+  }
+  curvm = saved;
+  return r;
+}
+
+/*
+ * 翻訳済みの文 [*p, end) をおよそquota命令ずつ実行する (hocd)
+ * 使い切ったら途中の状態をVMに残して戻り、次の呼び出しで続ける。
+ * *pは次に始める文で、文が終わるごとに進める。エラーになったら残りは実行しない。
+ */
+int vm_slice(HocVM *vm, Inst **p, Inst *end, long quota) /* 1 if paused, 0 when done, -1 on an error */
+{
+  HocVM *saved = curvm;
+  volatile int r = 1;
+
+  curvm = vm;
+  vm->slice = quota;
+  if (setjmp(vm->begin) == 0) {
+    while (vm->paused || *p < end) {
+      if (!vm->paused) {
+        if (vm->slice <= 0) { /* 文の間で譲る */
+          break;
+        }
+        initstack();
+        vm->pc = *p;
+        vm->nctl = 0;
+        vm->depth = 1;
+      }
+      if ((vm->paused = resume(vm)) != 0) {
+        break;
+      }
+      *p = vm->pc + 1;
+    }
+    if (!vm->paused && *p >= end) {
+      r = 0;
+    }
+  } else {
+    vm->nerrors++;
+    vm->paused = 0;
+    r = -1;
+  }
+  curvm = saved;
+  return r;
+}
+
+/*
+ * 実行の予算
+ * executeは命令ごとにstepsを減らすだけで、負になったときにvm_tickで
+ * 命令数の予算と期限を調べる。時計を読むのはTICK命令に1回になる。
+ * 予算が無いときはstepsをLONG_MAXにしておくので、実際には調べない。
+ */
+#define TICK 65536
+
+static void newwindow(HocVM *vm)
+{
+  long n = LONG_MAX;
+
+  if (vm->ileft >= 0 || vm->deadline > 0) {
+    n = TICK;
+  }
+  if (vm->ileft >= 0 && vm->ileft < n) {
+    n = vm->ileft;
+  }
+  if (vm->ileft >= 0) {
+    vm->ileft -= n;
+  }
+  vm->done += vm->window - vm->steps;
+  vm->window = vm->steps = n;
+}
+
+void vm_budget(HocVM *vm, long insts, double deadline) /* limit what runs next, 0: no limit */
+{
+  vm->ileft = insts > 0 ? insts : -1;
+  vm->deadline = deadline;
+  newwindow(vm);
+}
+
+void vm_tick(HocVM *vm) /* steps ran out: check the budget */
+{
+  if (vm->ileft == 0) {
+    vm->steps = 0;
+    execerror("instruction limit exceeded", (char *) 0);
+  }
+  if (vm->deadline > 0 && vm_clock() >= vm->deadline) {
+    vm->steps = 0;
+    execerror("time limit exceeded", (char *) 0);
+  }
+  vm->steps = 0; /* 今から実行する命令は次の窓で数える */
+  newwindow(vm);
+  vm->steps--; /* 今から実行する命令の分 */
+}
+
+double vm_clock(void) /* seconds on a monotonic clock */
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void vm_stats(HocVM *vm, FILE *fp) /* print allocation statistics */
+{
+  arena_stats(&vm->symarena, "symbols", fp);
+  arena_stats(&vm->stmtarena, "statement", fp);
+  stmt_stats(vm, fp);
+  vec_stats(vm, fp);
+  reg_stats(vm, fp);
+}
+
+long vm_insts(HocVM *vm) /* instructions executed so far */
+{
+  return vm->done + (vm->window - vm->steps);
+}
+
+void vm_charge(HocVM *vm, long n) /* n instructions ran elsewhere for vm */
+{
+  long left = vm->ileft + vm->steps;
+
+  vm->done += n;
+  if (vm->ileft >= 0) { /* 今の窓を閉じて残りから引く 尽きていれば次の命令で止まる */
+    vm->done += vm->window - vm->steps;
+    vm->ileft = left > n ? left - n : 0;
+    vm->window = vm->steps = 0;
+    newwindow(vm);
+  }
+}
+
+double Clock(double x) /* clock(): nanoseconds on a monotonic clock */
+{
+  struct timespec ts;
+
+  (void)x; /* 引数は使わない clock() は0を渡す */
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+double Cycles(double x) /* cycles(): CPU cycle counter, nanoseconds where there is none */
+{
+  (void)x;
+#if defined(__x86_64__) || defined(__i386__)
+  return (double)__rdtsc();
+#elif defined(__aarch64__)
+  uint64_t t;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+  return (double)t;
+#else
+  return Clock(x);
+#endif
+}
@@ -0,0 +1,181 @@
+/* A Bison parser, made by GNU Bison 3.8.2.  */
+
+/* Bison interface for Yacc-like parsers in C
+
+   Copyright (C) 1984, 1989-1990, 2000-2015, 2018-2021 Free Software Foundation,
+   Inc.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.  */
+
+/* As a special exception, you may create a larger work that contains
+   part or all of the Bison parser skeleton and distribute that work
+   under terms of your choice, so long as that work isn't itself a
+   parser generator using the skeleton or a modified version thereof
+   as a parser skeleton.  Alternatively, if you modify or redistribute
+   the parser skeleton itself, you may (at your option) remove this
+   special exception, which will cause the skeleton and the resulting
+   Bison output files to be licensed under the GNU General Public
+   License without this special exception.
+
+   This special exception was added by the Free Software Foundation in
+   version 2.2 of Bison.  */
+
+/* DO NOT RELY ON FEATURES THAT ARE NOT DOCUMENTED in the manual,
+   especially those whose name start with YY_ or yy_.  They are
+   private implementation details that can be changed or removed.  */
+
+#ifndef YY_YY_Y_TAB_H_INCLUDED
+# define YY_YY_Y_TAB_H_INCLUDED
+/* Debug traces.  */
+#ifndef YYDEBUG
+# define YYDEBUG 0
+#endif
+#if YYDEBUG
+extern int yydebug;
+#endif
+
+/* Token kinds.  */
+#ifndef YYTOKENTYPE
+# define YYTOKENTYPE
+  enum yytokentype
+  {
+    YYEMPTY = -2,
+    YYEOF = 0,                     /* "end of file"  */
+    YYerror = 256,                 /* error  */
+    YYUNDEF = 257,                 /* "invalid token"  */
+    NUMBER = 258,                  /* NUMBER  */
+    PRINT = 259,                   /* PRINT  */
+    VAR = 260,                     /* VAR  */
+    BLTIN = 261,                   /* BLTIN  */
+    UNDEF = 262,                   /* UNDEF  */
+    WHILE = 263,                   /* WHILE  */
+    IF = 264,                      /* IF  */
+    ELSE = 265,                    /* ELSE  */
+    PARALLEL = 266,                /* PARALLEL  */
+    FOR = 267,                     /* FOR  */
+    REDUCE = 268,                  /* REDUCE  */
+    READ = 269,                    /* READ  */
+    SAVE = 270,                    /* SAVE  */
+    RESTORE = 271,                 /* RESTORE  */
+    LOAD = 272,                    /* LOAD  */
+    ARRAY = 273,                   /* ARRAY  */
+    TIME = 274,                    /* TIME  */
+    MAPFILE = 275,                 /* MAPFILE  */
+    FUNCTION = 276,                /* FUNCTION  */
+    PROCEDURE = 277,               /* PROCEDURE  */
+    FUNC = 278,                    /* FUNC  */
+    PROC = 279,                    /* PROC  */
+    RETURN = 280,                  /* RETURN  */
+    DERIVED = 281,                 /* DERIVED  */
+    DEFINE = 282,                  /* DEFINE  */
+    FIELD = 283,                   /* FIELD  */
+    STRING = 284,                  /* STRING  */
+    ADDEQ = 285,                   /* ADDEQ  */
+    SUBEQ = 286,                   /* SUBEQ  */
+    MULEQ = 287,                   /* MULEQ  */
+    DIVEQ = 288,                   /* DIVEQ  */
+    INCREMENT = 289,               /* INCREMENT  */
+    DECREMENT = 290,               /* DECREMENT  */
+    OR = 291,                      /* OR  */
+    AND = 292,                     /* AND  */
+    GT = 293,                      /* GT  */
+    GE = 294,                      /* GE  */
+    LT = 295,                      /* LT  */
+    LE = 296,                      /* LE  */
+    EQ = 297,                      /* EQ  */
+    NE = 298,                      /* NE  */
+    UNARYPLUS = 299,               /* UNARYPLUS  */
+    UNARYMINUS = 300,              /* UNARYMINUS  */
+    NOT = 301                      /* NOT  */
+  };
+  typedef enum yytokentype yytoken_kind_t;
+#endif
+/* Token kinds.  */
+#define YYEMPTY -2
+#define YYEOF 0
+#define YYerror 256
+#define YYUNDEF 257
+#define NUMBER 258
+#define PRINT 259
+#define VAR 260
+#define BLTIN 261
+#define UNDEF 262
+#define WHILE 263
+#define IF 264
+#define ELSE 265
+#define PARALLEL 266
+#define FOR 267
+#define REDUCE 268
+#define READ 269
+#define SAVE 270
+#define RESTORE 271
+#define LOAD 272
+#define ARRAY 273
+#define TIME 274
+#define MAPFILE 275
+#define FUNCTION 276
+#define PROCEDURE 277
+#define FUNC 278
+#define PROC 279
+#define RETURN 280
+#define DERIVED 281
+#define DEFINE 282
+#define FIELD 283
+#define STRING 284
+#define ADDEQ 285
+#define SUBEQ 286
+#define MULEQ 287
+#define DIVEQ 288
+#define INCREMENT 289
+#define DECREMENT 290
+#define OR 291
+#define AND 292
+#define GT 293
+#define GE 294
+#define LT 295
+#define LE 296
+#define EQ 297
+#define NE 298
+#define UNARYPLUS 299
+#define UNARYMINUS 300
+#define NOT 301
+
+/* Value type.  */
+#if ! defined YYSTYPE && ! defined YYSTYPE_IS_DECLARED
+union YYSTYPE
+{
+#line 21 "hoc.y"
+
+  Symbol *sym;  /* symbol table pointer */
+  Inst *inst; /* machine instruction */
+  Reduce *red; /* reduction list of parallel for */
+  int num;
+  char *str;
+  Symbol **syms; /* names of load() */
+
+#line 168 "y.tab.h"
+
+};
+typedef union YYSTYPE YYSTYPE;
+# define YYSTYPE_IS_TRIVIAL 1
+# define YYSTYPE_IS_DECLARED 1
+#endif
+
+
+
+
+int yyparse (void);
+
+
+#endif /* !YY_YY_Y_TAB_H_INCLUDED  */